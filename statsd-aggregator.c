@@ -5,6 +5,9 @@
 
 #pragma GCC diagnostic ignored "-Wstrict-aliasing"
 
+// for cpu affinity
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -19,6 +22,20 @@
 #include <errno.h>
 #include <pthread.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <dirent.h>
+#include <math.h>
+#include <endian.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 // Size of buffer for outgoing packets. Should be below MTU.
 // TODO Probably should be configured via configuration file?
@@ -36,6 +53,12 @@
 
 #define MAX_COUNTER_LENGTH 18 // because of "%.15g|c\n"
 
+// size of hash index over slots, power of 2 and at least twice NUM_OF_SLOTS
+// so that linear probing chains stay short
+#define SLOT_INDEX_SIZE 512
+// hashers consume names by blocks of this size
+#define NAME_HASH_BLOCK_SIZE 16
+
 // default interval to check if downstream ips changed
 #define DEFAULT_DNS_REFRESH_INTERVAL 60
 
@@ -43,8 +66,88 @@
 #define DEFAULT_DOWNSTREAM_HEALTHCHECK_INTERVAL 1.0
 
 #define DEFAULT_LOG_LEVEL 0
+// buffer that failed to be sent with ENOBUFS or EAGAIN is retried up to this many times while it is younger than max age
+#define DEFAULT_DOWNSTREAM_SEND_RETRIES 3
+#define DEFAULT_DOWNSTREAM_SEND_MAX_AGE 1.0
+// delay before the first retry, every next retry waits twice as long
+#define DOWNSTREAM_SEND_RETRY_DELAY 0.01
 #define MAX_DOWNSTREAM_NUM 32
 #define MAX_PACKETS_PER_SOCKET 1000
+// loop thread follows incoming cpu only after packets came on it for this many flush intervals in a row
+#define FOLLOW_INCOMING_CPU_INTERVALS 3
+// how many addresses we can listen on and how long metric prefix of the listener can be
+#define MAX_LISTENERS 16
+#define MAX_PREFIX_LENGTH 128
+// how many datagrams are read by single recvmmsg() call
+#define RECV_BATCH_SIZE 16
+// busy polling falls back to epoll after this many empty polls in a row
+#define DEFAULT_BUSY_POLL_IDLE_SPINS 100000
+// loop load is the share of time spent processing datagrams over window of this many seconds
+#define LOAD_WINDOW 0.1
+
+// space for SO_TIMESTAMPNS control message of every datagram
+#define TIMESTAMP_CONTROL_SIZE CMSG_SPACE(sizeof(struct timespec))
+// lateness window is kept in memory as ring of slot tables, one per interval
+#define MAX_LATENESS_WINDOW 64
+#define TIMESTAMP_SUFFIX_SIZE 32
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+// debug tap: how many clients can be attached at once and how long filter line can be
+#define MAX_TAP_CLIENTS 8
+#define TAP_FILTER_BUF_SIZE 256
+// tap clients are allowed to lag, lines that don't fit into socket buffer are dropped
+#define TAP_SOCKET_SNDBUF (1024 * 1024)
+#define TAP_LISTEN_BACKLOG 4
+
+// name aliases: clients register "<id> <name>" lines over unix socket and then send "#<id>:<values>" lines
+#define MAX_ALIASES 32768
+#define MAX_ALIAS_CLIENTS 8
+#define ALIAS_LINE_BUF_SIZE 1024
+#define ALIAS_LISTEN_BACKLOG 4
+
+// marks whitespace in the sanitize table, runs of whitespace become single '_'
+#define SANITIZE_SPACE 1
+
+// huge page size used to round and align memory region
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+// chunks of memory region are aligned to cache line
+#define CACHE_LINE_SIZE 64
+
+// share of max_memory left after startup at which aggregator starts to degrade: flushes every datagram,
+// then counts lines with names it doesn't have slots for in overflow metric, then drops timers
+#define MEMORY_FLUSH_THRESHOLD 0.75
+#define MEMORY_REFUSE_THRESHOLD 0.9
+#define MEMORY_SHED_THRESHOLD 0.95
+// lines refused because of memory pressure are counted as this metric
+#define OVERFLOW_METRIC_LINE "statsd-aggregator.overflow:1|c\n"
+#define OVERFLOW_METRIC_NAME_LENGTH (STRLEN("statsd-aggregator.overflow"))
+
+// settings for metrics with names starting with given prefix
+#define MAX_RULES 32
+// histogram has one bin per configured bound plus one for values above the last bound
+#define MAX_HISTOGRAM_BINS 32
+#define MAX_BIN_LABEL_LENGTH 32
+#define HISTOGRAM_BIN_PREFIX ".bin_"
+// bin count is fractional with sample rates, so any "%.15g" is reserved, e.g. "-1.23456789012345e-300|c\n"
+#define MAX_BIN_COUNT_LENGTH 25
+// timers of names with max_samples keep at most this many values per flush
+#define MAX_SAMPLES 32
+#define MAX_SAMPLE_LENGTH 40 // because of "%.15g|ms|@%.6g:"
+
+// datagram starting with this byte is binary, it is not valid first byte of text line
+#define BINARY_MAGIC 0xA7
+// binary record is name length (uint16), name, type byte, value and rate (doubles), all little endian
+#define BINARY_VALUE_SIZE (1 + 2 * sizeof(double))
+#define MAX_BINARY_VALUE_LENGTH 50 // because of "%.15g|ms|@%.15g:"
+// name length of binary record with this bit set is alias id, name is not sent
+#define BINARY_ALIAS_FLAG 0x8000
+
+// size of buffer for commands driving virtual clock
+#define CLOCK_COMMAND_BUF_SIZE 256
+#define CLOCK_ADVANCE_COMMAND "advance "
 
 // structure to accumulate metrics data for specific name
 typedef struct {
@@ -53,8 +156,56 @@ typedef struct {
     int length;
     double counter;
     int type;
+    // hash of the name (without ':') and position in the slot index
+    uint32_t hash;
+    int index_pos;
+    // rule the name matched, looked up when slot gets its type
+    struct rule_s *rule;
 } slot_s;
 
+// timer value kept in reservoir of sampled slot
+typedef struct {
+    double value;
+    double rate;
+} sample_s;
+
+// state of the name hashing, hashers consume name by 16 byte blocks
+typedef struct {
+    uint64_t a;
+    uint64_t b;
+} name_hash_state_s;
+
+// name hashing implementation, selected at runtime depending on cpu features
+struct name_hasher_s {
+    char *name;
+    // returns non zero if cpu supports this implementation
+    int (*supported)();
+    void (*init)(name_hash_state_s *state);
+    void (*block)(name_hash_state_s *state, const char *block);
+    uint32_t (*finish)(name_hash_state_s *state, const char *tail, int tail_length, int length);
+    // hashes whole name at once, same result as init() + block() + finish()
+    uint32_t (*hash)(const char *name, int length);
+};
+
+// reasons why metrics line is skipped
+#define LINE_INVALID_LENGTH 1
+#define LINE_INVALID_METRIC 2
+
+// metrics line of the datagram, prepare_data_line() finds its name and hashes it
+typedef struct {
+    char *line;
+    int length;
+    // position of ':' in the line
+    char *colon_ptr;
+    // length of the name including ':' and its hash
+    int name_length;
+    uint32_t hash;
+    // 0 if line is valid, LINE_INVALID_LENGTH or LINE_INVALID_METRIC otherwise
+    int error;
+    // id of the name alias for lines like "#12:1|c", -1 otherwise
+    int alias;
+} line_s;
+
 #define STRLEN(s) (sizeof(s) / sizeof(s[0]) - 1)
 
 #define DOWNSTREAM_HEALTH_CHECK_BUF_SIZE 32
@@ -71,37 +222,303 @@ struct downstream_health_client_s {
     unsigned int alive:1;
 };
 
+// directions of the debug tap, used as bit mask
+#define TAP_IN 1
+#define TAP_OUT 2
+
+struct tap_client_s {
+    // ev_io structure used to read filter line and detect disconnect
+    struct ev_io super;
+    // filter line as received from client, ends with '\n' once complete
+    char filter[TAP_FILTER_BUF_SIZE];
+    int filter_length;
+    // which data client wants to see (TAP_IN, TAP_OUT or both)
+    int direction;
+    // only lines starting with this prefix are sent to the client
+    char *prefix;
+    int prefix_length;
+    // how many lines were dropped because client is too slow
+    int dropped;
+    // bit flag if this client slot is in use
+    unsigned int used:1;
+    // bit flag if filter line was received and client gets data
+    unsigned int ready:1;
+};
+
+// structure that holds debug tap data
+struct tap_s {
+    // path of the unix socket clients connect to
+    char *socket_path;
+    // ev_io structure used to accept clients
+    struct ev_io accept_watcher;
+    // how many clients are receiving data, checked on the hot path
+    int clients_ready;
+    struct tap_client_s clients[MAX_TAP_CLIENTS];
+};
+
+// name registered by client, slot of the name is cached until its table is reset
+struct alias_s {
+    // name includes ':', NULL if id is not registered
+    char *name;
+    int name_length;
+    uint32_t hash;
+    struct slot_table_s *table;
+    unsigned long generation;
+    int slot_idx;
+};
+
+struct alias_client_s {
+    // ev_io structure used to read registration lines
+    struct ev_io super;
+    // incomplete line received from client
+    char buffer[ALIAS_LINE_BUF_SIZE];
+    int length;
+    // bit flag if this client slot is in use
+    unsigned int used:1;
+};
+
+// structure that holds name aliases and their control socket
+struct aliases_s {
+    // path of the unix socket clients register aliases on, aliases are disabled without it
+    char *socket_path;
+    // ev_io structure used to accept clients
+    struct ev_io accept_watcher;
+    // MAX_ALIASES entries indexed by id
+    struct alias_s *names;
+    struct alias_client_s clients[MAX_ALIAS_CLIENTS];
+    // lines with ids nobody registered
+    uint64_t unknown;
+};
+
+// clock driving flush and health check timers
+enum clock_e {
+    CLOCK_REAL,
+    CLOCK_VIRTUAL
+};
+
+// structure that holds virtual clock data, it is advanced by the commands read from stdin
+struct virtual_clock_s {
+    // current virtual time, starts from 0
+    ev_tstamp now;
+    // when timers should fire next time
+    ev_tstamp next_flush;
+    ev_tstamp next_health_check;
+    // ev_io structure used to read commands
+    struct ev_io command_watcher;
+    char command[CLOCK_COMMAND_BUF_SIZE];
+    int command_length;
+};
+
+// what kind of pages back the memory region
+enum huge_pages_e {
+    HUGE_PAGES_NONE,
+    HUGE_PAGES_TRANSPARENT,
+    HUGE_PAGES_EXPLICIT
+};
+
+// memory pressure levels, each one includes actions of the previous ones
+enum memory_pressure_e {
+    MEMORY_PRESSURE_NONE,
+    MEMORY_PRESSURE_FLUSH,
+    MEMORY_PRESSURE_REFUSE,
+    MEMORY_PRESSURE_SHED
+};
+
+// structure that holds memory region used for slots, slot index and output buffers
+// and accounting of all memory allocated via mem_alloc()
+struct memory_s {
+    // requested kind of pages (HUGE_PAGES_*)
+    int huge_pages;
+    char *region;
+    size_t size;
+    // how much of the region is already given out
+    size_t used;
+    // memory budget, 0 means unlimited
+    size_t max;
+    // how much memory is accounted (region included)
+    size_t allocated;
+    // memory accounted when startup is done, 0 before that. It stays for the whole run, so pressure
+    // levels are shares of the budget left after it
+    size_t baseline;
+    // current MEMORY_PRESSURE_* level, checked on the hot path
+    int pressure;
+};
+
+// structure that holds self-metrics state
+struct stats_s {
+    // how often stats are logged, 0 means never
+    ev_tstamp interval;
+    // perf event counting dTLB load misses of the loop thread, -1 if not available
+    int dtlb_misses_fd;
+    uint64_t dtlb_misses;
+    // lines and values dropped because of memory pressure
+    uint64_t names_refused;
+    uint64_t values_shed;
+    // allocations that failed because of max_memory
+    uint64_t allocations_failed;
+    // sends of output buffers that failed and were retried, buffers dropped after failed send
+    uint64_t send_retries;
+    uint64_t send_drops;
+};
+
+// address we get data on, with its own socket options and processing
+struct listener_s {
+    // ev_io structure used when we wait for data via epoll
+    struct ev_io super;
+    struct sockaddr_in addr;
+    // prepended to every metric name received by this listener
+    char *prefix;
+    int prefix_length;
+    // SO_RCVBUF of the socket, 0 means system default
+    int rcvbuf;
+};
+
+// structure that holds data sockets reading state
+struct ingest_s {
+    // ev_idle structure used to spin on the socket in busy poll mode
+    struct ev_idle busy_poll_watcher;
+    // datagrams read by single recvmmsg(), buffers are RECV_BATCH_SIZE * DATA_BUF_SIZE bytes
+    struct mmsghdr messages[RECV_BATCH_SIZE];
+    struct iovec iovecs[RECV_BATCH_SIZE];
+    char *buffers;
+    // SO_BUSY_POLL value in microseconds, 0 means busy polling is disabled
+    int busy_poll;
+    // how many empty polls in a row make us fall back to epoll
+    int busy_poll_idle_spins;
+    // how many empty polls in a row we've done so far
+    int spins;
+    // how many times we switched between spinning and epoll
+    uint64_t busy_poll_switches;
+    // loop load at which datagram coming via epoll starts spinning, 0 means any datagram does
+    double busy_poll_load;
+    // time spent processing datagrams since the window start and load of the last complete window
+    ev_tstamp busy_time;
+    ev_tstamp load_window_start;
+    double load;
+    // flag that last recvmmsg() filled the whole batch, so more datagrams are likely waiting in the socket
+    int backlog;
+    // datagram with listener prefix prepended to every line
+    char prefix_buffer[DATA_BUF_SIZE + MAX_PREFIX_LENGTH];
+    // flag if datagrams are attributed to flush intervals by kernel receive time
+    int timestamps;
+    char control[RECV_BATCH_SIZE][TIMESTAMP_CONTROL_SIZE];
+    // start of the interval we are aggregating now
+    ev_tstamp interval_start;
+    // datagrams that arrived in already flushed interval
+    uint64_t late_packets;
+    // flushes done because datagram from the next interval came before flush timer
+    uint64_t early_flushes;
+};
+
+// settings applied to metrics with names starting with prefix, longest matching prefix wins
+struct rule_s {
+    char *prefix;
+    int prefix_length;
+    // upper bounds of histogram bins padded with INFINITY, 0 bins means |h and |d values are kept as is
+    double bounds[MAX_HISTOGRAM_BINS];
+    int bins_num;
+    // bins are emitted as counters <name>.bin_<label>, label is bound with '.' replaced by '_'
+    char labels[MAX_HISTOGRAM_BINS][MAX_BIN_LABEL_LENGTH];
+    int label_lengths[MAX_HISTOGRAM_BINS];
+    int labels_length;
+    // timer, |h and |d values are rounded to this many significant digits or to multiple of the step, 0 means as is
+    int quantize_digits;
+    double quantize_step;
+    // timer values kept per name by reservoir sampling, 0 means all values are kept
+    int max_samples;
+};
+
+// structure that holds metrics with explicit timestamps
+struct lateness_s {
+    // for how many intervals (current one included) timestamped lines are accepted, 0 means |T is not parsed
+    int window;
+    // ring of slot tables, one per interval of the window, allocated via mem_alloc()
+    struct slot_table_s *tables;
+    // timestamped lines that are in the future or older than the window
+    uint64_t out_of_window;
+    // lines with values from different intervals, they go to the interval of the first timestamp
+    uint64_t mixed_intervals;
+};
+
+// structure that holds cpu placement of the loop thread
+struct cpu_s {
+    // cpus loop thread is pinned to, used only if pinned is set
+    cpu_set_t affinity;
+    int pinned;
+    // flag if loop thread should follow cpu that handles packets of the data socket
+    int follow_incoming_cpu;
+    // cpu and numa node loop thread was last moved to by following, -1 if never
+    int current;
+    int node;
+    // cpu packets came on for the last candidate_intervals flush intervals in a row
+    int candidate;
+    int candidate_intervals;
+};
+
+// slots of one flush interval with hash index over them
+struct slot_table_s {
+    // slots for accumulating metrics, NUM_OF_SLOTS of them
+    slot_s *slots;
+    // how many slots are used
+    int slots_used;
+    // hash index over used slots, contains slot index + 1, 0 means empty, SLOT_INDEX_SIZE entries
+    int *slot_index;
+    // how much space data of the slots takes in the output buffer
+    int length;
+    // number of the interval for tables of the lateness window
+    long interval;
+    // "|T<interval start>" appended to every value on flush, empty for the current interval
+    char suffix[TIMESTAMP_SUFFIX_SIZE];
+    int suffix_length;
+    // incremented on every reset, slots cached by aliases are valid for the same generation only
+    unsigned long generation;
+};
+
 struct downstream_host_s {
     struct sockaddr_in sa_in_data;
     struct downstream_host_s *next;
     struct downstream_health_client_s health_client;
 };
 
+/* addresses of the downstream host resolved by downstream_refresh() thread. Snapshot is never changed
+ * after it is published, event loop takes it over and frees it.
+ */
+struct downstream_addrs_s {
+    int num;
+    struct in_addr addrs[MAX_DOWNSTREAM_NUM];
+};
+
 // structure that holds downstream data
 struct downstream_s {
     // buffer where data is added
     int active_buffer_idx;
     char *active_buffer;
-    int active_buffer_length;
     // buffer ready for flush
     int flush_buffer_idx;
-    // memory for active and flush buffers
-    char buffer[DOWNSTREAM_BUF_SIZE * DOWNSTREAM_BUF_NUM];
+    // memory for active and flush buffers, DOWNSTREAM_BUF_SIZE * DOWNSTREAM_BUF_NUM bytes
+    char *buffer;
     // lengths of buffers from the above array
     int buffer_length[DOWNSTREAM_BUF_NUM];
+    // when buffers were filled, failed sends are not retried for buffers older than send_max_age
+    ev_tstamp buffer_time[DOWNSTREAM_BUF_NUM];
+    // failed sends of the buffer at flush_buffer_idx
+    int flush_retries;
+    // retry budget and age limit of a buffer, SO_SNDBUF of the socket (0 means system default)
+    int send_retries;
+    ev_tstamp send_max_age;
+    int sndbuf;
     char *data_host;
     int data_port;
     int health_port;
-    // new ip addrs filled in by the downstream_refresh()
-    struct in_addr in_addr_new[MAX_DOWNSTREAM_NUM];
-    // flag that new sockaddr data is available
-    int in_addr_new_ready;
+    // latest addresses published by the downstream_refresh(), NULL once event loop took them,
+    // accessed only with atomic exchange
+    struct downstream_addrs_s *addrs_new;
     // id extended ev_io structure used for sending data to downstream
     struct ev_io flush_watcher;
-    // slots for accumulating metrics
-    slot_s slots[NUM_OF_SLOTS];
-    // how many slots are used
-    int slots_used;
+    // timer that starts flush_watcher again after failed send, flush_watcher is stopped meanwhile
+    struct ev_timer retry_watcher;
+    // slots of the current interval
+    struct slot_table_s slot_table;
     // how many downstream hosts we have
     int downstream_host_num;
     struct downstream_host_s *downstream_hosts;
@@ -111,7 +528,7 @@ struct downstream_s {
 
 // globally accessed structure with commonly used data
 struct global_s {
-    // port we are listening on
+    // port we are listening on if no listeners are configured
     int data_port;
     struct downstream_s downstream;
     // how often we flush data
@@ -122,6 +539,29 @@ struct global_s {
     int dns_refresh_interval;
     // how often we check health of the downstreams
     ev_tstamp downstream_health_check_interval;
+    // debug tap mirroring input and output lines
+    struct tap_s tap;
+    // names registered by clients to send short ids instead
+    struct aliases_s aliases;
+    // addresses we are getting data from
+    struct listener_s listeners[MAX_LISTENERS];
+    int listeners_num;
+    // what drives our timers (CLOCK_REAL or CLOCK_VIRTUAL)
+    int clock;
+    // name hashing implementation in use
+    struct name_hasher_s *name_hasher;
+    // flag if metric names should be made graphite compatible
+    int sanitize_names;
+    // replacement for every byte of the name, 0 means byte is removed
+    unsigned char sanitize_table[256];
+    struct virtual_clock_s virtual_clock;
+    struct memory_s memory;
+    struct stats_s stats;
+    struct cpu_s cpu;
+    struct ingest_s ingest;
+    struct lateness_s lateness;
+    struct rule_s rules[MAX_RULES];
+    int rules_num;
 };
 
 struct global_s global;
@@ -138,7 +578,9 @@ enum log_level_e {
 enum metric_type_e {
     TYPE_UNKNOWN,
     TYPE_COUNTER,
-    TYPE_OTHER
+    TYPE_OTHER,
+    TYPE_HISTOGRAM,
+    TYPE_SAMPLED
 };
 
 // and function to convert numeric values into strings
@@ -169,6 +611,64 @@ void log_msg(int level, char *format, ...) {
     fflush(stdout);
 }
 
+void tap_client_close(struct ev_loop *loop, struct tap_client_s *client) {
+    if (client->ready == 1) {
+        global.tap.clients_ready--;
+        log_msg(INFO, "%s: tap client detached, %d lines dropped", __func__, client->dropped);
+    }
+    ev_io_stop(loop, &(client->super));
+    close(client->super.fd);
+    client->used = 0;
+    client->ready = 0;
+}
+
+// function to send line to the tap clients with matching filter
+void tap_line(int direction, char *line, int length) {
+    static char *tag[] = { "", "in ", "out " };
+    struct tap_client_s *client = NULL;
+    struct iovec iov[3];
+    struct msghdr msg;
+    int i = 0;
+    int n = 0;
+    int total = 0;
+
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    iov[0].iov_base = tag[direction];
+    iov[0].iov_len = strlen(tag[direction]);
+    iov[1].iov_base = line;
+    iov[1].iov_len = length;
+    total = iov[0].iov_len + length;
+    // lines from the input can come without trailing '\n'
+    if (line[length - 1] != '\n') {
+        iov[2].iov_base = "\n";
+        iov[2].iov_len = 1;
+        msg.msg_iovlen = 3;
+        total++;
+    }
+    for (i = 0; i < MAX_TAP_CLIENTS; i++) {
+        client = global.tap.clients + i;
+        if (client->ready == 0 || (client->direction & direction) == 0) {
+            continue;
+        }
+        if (client->prefix_length > length || memcmp(line, client->prefix, client->prefix_length) != 0) {
+            continue;
+        }
+        n = sendmsg(client->super.fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n == total) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            client->dropped++;
+            continue;
+        }
+        // partial write breaks line framing, so client is disconnected
+        log_msg(WARN, "%s: tap client is too slow or gone, disconnecting", __func__);
+        tap_client_close(ev_default_loop(0), client);
+    }
+}
+
 void set_current_downstream_host() {
     struct downstream_host_s *host = global.downstream.current_downstream_host;
     int i = 0;
@@ -192,9 +692,27 @@ void set_current_downstream_host() {
     global.downstream.current_downstream_host = NULL;
 }
 
+// function to get current time of the clock driving our timers
+ev_tstamp clock_now() {
+    if (global.clock == CLOCK_VIRTUAL) {
+        return global.virtual_clock.now;
+    }
+    return ev_now(ev_default_loop(0));
+}
+
+// function to check if failed send of the buffer should be retried when socket is writable again
+int downstream_send_retriable(int error) {
+    if (error != ENOBUFS && error != EAGAIN && error != EWOULDBLOCK) {
+        return 0;
+    }
+    return global.downstream.flush_retries < global.downstream.send_retries &&
+        clock_now() - global.downstream.buffer_time[global.downstream.flush_buffer_idx] <= global.downstream.send_max_age;
+}
+
 // this function flushes data to downstream
 void downstream_flush_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
     int bytes_send;
+    int send_errno = 0;
     int flush_buffer_idx = global.downstream.flush_buffer_idx;
 
     if (EV_ERROR & revents) {
@@ -216,27 +734,188 @@ void downstream_flush_cb(struct ev_loop *loop, struct ev_io *watcher, int revent
         0,
         (struct sockaddr *) (&(global.downstream.current_downstream_host->sa_in_data)),
         sizeof(global.downstream.current_downstream_host->sa_in_data));
+    if (bytes_send < 0) {
+        send_errno = errno;
+        // buffer stays at the head of the queue, socket is usually writable right away, so retry waits for the timer
+        if (downstream_send_retriable(send_errno)) {
+            ev_io_stop(loop, watcher);
+            ev_timer_set(&(global.downstream.retry_watcher), DOWNSTREAM_SEND_RETRY_DELAY * (1 << global.downstream.flush_retries), 0);
+            ev_timer_start(loop, &(global.downstream.retry_watcher));
+            log_msg(DEBUG, "%s: sendto() failed %s, retrying in %.3fs", __func__, strerror(send_errno),
+                DOWNSTREAM_SEND_RETRY_DELAY * (1 << global.downstream.flush_retries));
+            global.downstream.flush_retries++;
+            global.stats.send_retries++;
+            return;
+        }
+        log_msg(ERROR, "%s: sendto() failed %s", __func__, strerror(send_errno));
+        global.stats.send_drops++;
+    }
     // update flush time
     global.downstream.buffer_length[flush_buffer_idx] = 0;
+    global.downstream.flush_retries = 0;
     global.downstream.packets_sent++;
     global.downstream.flush_buffer_idx = (flush_buffer_idx + 1) % DOWNSTREAM_BUF_NUM;
     log_msg(TRACE, "%s: flushed buffer %d", __func__, flush_buffer_idx);
     if (global.downstream.flush_buffer_idx == global.downstream.active_buffer_idx) {
         ev_io_stop(loop, watcher);
     }
-    if (bytes_send < 0) {
-        log_msg(ERROR, "%s: sendto() failed %s", __func__, strerror(errno));
+}
+
+void downstream_retry_cb(struct ev_loop *loop, struct ev_timer *watcher, int revents) {
+    ev_io_start(loop, &(global.downstream.flush_watcher));
+}
+
+// function to forget all slots of the table, only used entries of the index are cleared
+void reset_slots(struct slot_table_s *table) {
+    int i = 0;
+
+    for (i = 0; i < table->slots_used; i++) {
+        table->slot_index[table->slots[i].index_pos] = 0;
+    }
+    table->slots_used = 0;
+    table->length = 0;
+    table->generation++;
+}
+
+// function to copy slot of the lateness window table to the output buffer with suffix appended to every value
+int copy_timestamped_slot(char *target, slot_s *slot, struct slot_table_s *table) {
+    char *buffer_ptr = slot->buffer + slot->name_length;
+    char *end_ptr = slot->buffer + slot->length;
+    char *delimiter_ptr = NULL;
+    int length = slot->name_length;
+
+    memcpy(target, slot->buffer, slot->name_length);
+    while (buffer_ptr < end_ptr) {
+        // last value ends with '\n'
+        delimiter_ptr = memchr(buffer_ptr, ':', end_ptr - buffer_ptr);
+        if (delimiter_ptr == NULL) {
+            delimiter_ptr = end_ptr - 1;
+        }
+        memcpy(target + length, buffer_ptr, delimiter_ptr - buffer_ptr);
+        length += delimiter_ptr - buffer_ptr;
+        memcpy(target + length, table->suffix, table->suffix_length);
+        length += table->suffix_length;
+        target[length++] = *delimiter_ptr;
+        buffer_ptr = delimiter_ptr + 1;
+    }
+    return length;
+}
+
+// function to find rule with the longest prefix the name starts with, returns NULL if there is none
+struct rule_s *find_rule(char *name, int name_length) {
+    struct rule_s *rule = NULL;
+    int i = 0;
+
+    for (i = 0; i < global.rules_num; i++) {
+        if (global.rules[i].prefix_length < name_length && memcmp(name, global.rules[i].prefix, global.rules[i].prefix_length) == 0 &&
+                (rule == NULL || global.rules[i].prefix_length > rule->prefix_length)) {
+            rule = global.rules + i;
+        }
+    }
+    return rule;
+}
+
+// bin counts of histogram slot and reservoir of sampled slot are kept in its buffer right after the name
+void *slot_values(slot_s *slot) {
+    return slot->buffer + ((slot->name_length + sizeof(double) - 1) & ~(sizeof(double) - 1));
+}
+
+// function to get maximum length of histogram output, every bin is "<name>.bin_<label>:%.15g|c<suffix>\n"
+int histogram_length(struct rule_s *rule, int name_length, int suffix_length) {
+    return rule->bins_num * (name_length - 1 + STRLEN(HISTOGRAM_BIN_PREFIX) + 1 + MAX_BIN_COUNT_LENGTH + suffix_length) + rule->labels_length;
+}
+
+/* function to find histogram bin of the value without branches: bounds are padded with INFINITY
+ * to MAX_HISTOGRAM_BINS (power of two), so the loop is unrolled into fixed number of compares
+ * and conditional moves. Result is number of bounds less than the value.
+ */
+int histogram_bin(struct rule_s *rule, double value) {
+    int bin = 0;
+    int step = 0;
+
+    for (step = MAX_HISTOGRAM_BINS / 2; step > 0; step /= 2) {
+        bin += (rule->bounds[bin + step - 1] < value) * step;
+    }
+    return bin;
+}
+
+// function to copy histogram slot to the output buffer as one counter per bin
+int copy_histogram_slot(char *target, slot_s *slot, struct slot_table_s *table) {
+    struct rule_s *rule = slot->rule;
+    double *counts = slot_values(slot);
+    int line_start = 0;
+    int length = 0;
+    int i = 0;
+
+    for (i = 0; i < rule->bins_num; i++) {
+        line_start = length;
+        memcpy(target + length, slot->buffer, slot->name_length - 1);
+        length += slot->name_length - 1;
+        memcpy(target + length, HISTOGRAM_BIN_PREFIX, STRLEN(HISTOGRAM_BIN_PREFIX));
+        length += STRLEN(HISTOGRAM_BIN_PREFIX);
+        memcpy(target + length, rule->labels[i], rule->label_lengths[i]);
+        length += rule->label_lengths[i];
+        length += sprintf(target + length, ":%.15g|c", counts[i]);
+        memcpy(target + length, table->suffix, table->suffix_length);
+        length += table->suffix_length;
+        target[length++] = '\n';
+        if (global.tap.clients_ready > 0) {
+            tap_line(TAP_OUT, target + line_start, length - line_start);
+        }
+    }
+    return length;
+}
+
+// function to copy sampled slot to the output buffer, rate of every kept value is scaled by share of values kept
+int copy_sampled_slot(char *target, slot_s *slot, struct slot_table_s *table) {
+    sample_s *samples = slot_values(slot);
+    int kept = slot->counter < slot->rule->max_samples ? slot->counter : slot->rule->max_samples;
+    double rate = 0;
+    int length = slot->name_length;
+    int i = 0;
+
+    memcpy(target, slot->buffer, slot->name_length);
+    for (i = 0; i < kept; i++) {
+        rate = samples[i].rate * kept / slot->counter;
+        length += sprintf(target + length, "%.15g|ms", samples[i].value);
+        if (rate != 1) {
+            length += sprintf(target + length, "|@%.6g", rate);
+        }
+        memcpy(target + length, table->suffix, table->suffix_length);
+        length += table->suffix_length;
+        target[length++] = ':';
     }
+    target[length - 1] = '\n';
+    return length;
 }
 
-/* this function switches active and flush buffers, registers handler to send data when
- * socket would be ready
+int setnonblock(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    flags |= O_NONBLOCK;
+    return fcntl(fd, F_SETFL, flags);
+}
+
+/* function to set up socket used to send data to downstream: it is non blocking, so full send buffer
+ * doesn't stall the loop but fails the send with EAGAIN, and it gets configured SO_SNDBUF
+ */
+void setup_downstream_socket(int fd) {
+    if (setnonblock(fd) == -1) {
+        log_msg(WARN, "%s: fcntl() failed %s", __func__, strerror(errno));
+    }
+    if (global.downstream.sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &(global.downstream.sndbuf), sizeof(int)) != 0) {
+        log_msg(WARN, "%s: setsockopt(SO_SNDBUF) failed %s", __func__, strerror(errno));
+    }
+}
+
+/* this function copies slots of the table to active buffer, switches active and flush buffers,
+ * registers handler to send data when socket would be ready
  */
-void downstream_schedule_flush() {
+void downstream_schedule_flush(struct slot_table_s *table) {
     int new_socket_fd = 0;
     int i = 0;
     int slot_data_length = 0;
     int active_buffer_length = 0;
+    char *target_ptr = NULL;
     struct ev_io *watcher = NULL;
     int new_active_buffer_idx = (global.downstream.active_buffer_idx + 1) % DOWNSTREAM_BUF_NUM;
     // if active_buffer_idx == flush_buffer_idx this means that all previous
@@ -245,24 +924,38 @@ void downstream_schedule_flush() {
 
     if (global.downstream.buffer_length[new_active_buffer_idx] > 0) {
         log_msg(ERROR, "%s: previous flush is not completed, loosing data.", __func__);
-        global.downstream.active_buffer_length = 0;
-        global.downstream.slots_used = 0;
+        reset_slots(table);
         return;
     }
-    for (i = 0; i < global.downstream.slots_used; i++) {
-        slot_data_length = global.downstream.slots[i].length;
-        if (slot_data_length == global.downstream.slots[i].name_length) {
+    for (i = 0; i < table->slots_used; i++) {
+        slot_data_length = table->slots[i].length;
+        if (slot_data_length == table->slots[i].name_length) {
             continue;
         }
-        *(global.downstream.slots[i].buffer + slot_data_length - 1) = '\n';
-        memcpy(global.downstream.active_buffer + active_buffer_length, global.downstream.slots[i].buffer, slot_data_length);
+        target_ptr = global.downstream.active_buffer + active_buffer_length;
+        if (table->slots[i].type == TYPE_HISTOGRAM) {
+            active_buffer_length += copy_histogram_slot(target_ptr, table->slots + i, table);
+            continue;
+        }
+        if (table->slots[i].type == TYPE_SAMPLED) {
+            slot_data_length = copy_sampled_slot(target_ptr, table->slots + i, table);
+        } else if (table->suffix_length > 0) {
+            *(table->slots[i].buffer + slot_data_length - 1) = '\n';
+            slot_data_length = copy_timestamped_slot(target_ptr, table->slots + i, table);
+        } else {
+            *(table->slots[i].buffer + slot_data_length - 1) = '\n';
+            memcpy(target_ptr, table->slots[i].buffer, slot_data_length);
+        }
+        if (global.tap.clients_ready > 0) {
+            tap_line(TAP_OUT, target_ptr, slot_data_length);
+        }
         active_buffer_length += slot_data_length;
     }
     log_msg(TRACE, "%s: flushing buffer: \"%.*s\"", __func__, active_buffer_length, global.downstream.active_buffer);
     global.downstream.buffer_length[global.downstream.active_buffer_idx] = active_buffer_length;
+    global.downstream.buffer_time[global.downstream.active_buffer_idx] = clock_now();
     global.downstream.active_buffer = global.downstream.buffer + new_active_buffer_idx * DOWNSTREAM_BUF_SIZE;
-    global.downstream.active_buffer_length = 0;
-    global.downstream.slots_used = 0;
+    reset_slots(table);
     global.downstream.active_buffer_idx = new_active_buffer_idx;
     log_msg(TRACE, "%s: new active buffer idx = %d", __func__, new_active_buffer_idx);
     if (need_to_schedule_flush) {
@@ -275,6 +968,7 @@ void downstream_schedule_flush() {
             } else {
                 close(watcher->fd);
                 watcher->fd = new_socket_fd;
+                setup_downstream_socket(new_socket_fd);
             }
         }
         ev_io_init(watcher, downstream_flush_cb, watcher->fd, EV_WRITE);
@@ -282,50 +976,317 @@ void downstream_schedule_flush() {
     }
 }
 
-int add_slot(char *line, int name_length) {
-    global.downstream.slots[global.downstream.slots_used].name_length = name_length;
-    global.downstream.slots[global.downstream.slots_used].length = name_length;
-    global.downstream.slots[global.downstream.slots_used].type = TYPE_UNKNOWN;
-    global.downstream.slots[global.downstream.slots_used].counter = 0.0;
-    global.downstream.active_buffer_length += name_length;
-    memcpy(global.downstream.slots[global.downstream.slots_used].buffer, line, name_length);
-    log_msg(TRACE, "%s: created %.*s at slot %d", __func__, name_length, line, global.downstream.slots_used);
-    return global.downstream.slots_used++;
+int add_slot(struct slot_table_s *table, char *line, int name_length, uint32_t hash) {
+    slot_s *slot = table->slots + table->slots_used;
+    int pos = hash & (SLOT_INDEX_SIZE - 1);
+
+    slot->name_length = name_length;
+    slot->length = name_length;
+    slot->type = TYPE_UNKNOWN;
+    slot->counter = 0.0;
+    slot->hash = hash;
+    slot->rule = NULL;
+    table->length += name_length;
+    // name could come from the buffer of the same slot before reset
+    memmove(slot->buffer, line, name_length);
+    while (table->slot_index[pos] != 0) {
+        pos = (pos + 1) & (SLOT_INDEX_SIZE - 1);
+    }
+    table->slot_index[pos] = table->slots_used + 1;
+    slot->index_pos = pos;
+    log_msg(TRACE, "%s: created %.*s at slot %d", __func__, name_length, line, table->slots_used);
+    return table->slots_used++;
 }
 
-int find_slot(char *line, int name_length) {
+// function to find existing slot for the name, returns -1 if there is none
+int lookup_slot(struct slot_table_s *table, char *line, int name_length, uint32_t hash) {
+    slot_s *slot = NULL;
+    int pos = hash & (SLOT_INDEX_SIZE - 1);
     int i = 0;
-    for (i = 0; i < global.downstream.slots_used; i++) {
-        if (global.downstream.slots[i].name_length == name_length) {
-            if (memcmp(line, global.downstream.slots[i].buffer, name_length) == 0) {
-                log_msg(TRACE, "%s: found %.*s at slot %d", __func__, name_length, line, i);
-                return i;
+
+    while ((i = table->slot_index[pos]) != 0) {
+        slot = table->slots + i - 1;
+        if (slot->hash == hash && slot->name_length == name_length && memcmp(line, slot->buffer, name_length) == 0) {
+            log_msg(TRACE, "%s: found %.*s at slot %d", __func__, name_length, line, i - 1);
+            return i - 1;
+        }
+        pos = (pos + 1) & (SLOT_INDEX_SIZE - 1);
+    }
+    return -1;
+}
+
+int find_slot(struct slot_table_s *table, char *line, int name_length, uint32_t hash) {
+    int slot_idx = lookup_slot(table, line, name_length, hash);
+
+    if (slot_idx >= 0) {
+        return slot_idx;
+    }
+    // short names with invalid data take little space in the buffer, so number of slots is checked too
+    if (table->length + name_length > DOWNSTREAM_BUF_SIZE || table->slots_used == NUM_OF_SLOTS) {
+        log_msg(TRACE, "%s: table length = %d, name_length = %d, scheduling flush", __func__, table->length, name_length);
+        downstream_schedule_flush(table);
+    }
+    return add_slot(table, line, name_length, hash);
+}
+
+// function to get sample rate of the value like "1|c|@0.1", returns 1 if rate is missing or invalid
+double value_rate(char *buffer_ptr, char *type_ptr, int data_length) {
+    char *rate_ptr = memchr(type_ptr + 1, '|', data_length - (type_ptr - buffer_ptr) - 1);
+    char *endptr = NULL;
+    double rate = 1;
+
+    if (rate_ptr != NULL && *(rate_ptr + 1) == '@') {
+        errno = 0;
+        rate = strtod(rate_ptr + 2, &endptr);
+        if (errno != 0 || (endptr + 1) != (buffer_ptr + data_length)) {
+            log_msg(TRACE, "%s: invalid rate in data \"%.*s\"", __func__, data_length - 1, buffer_ptr);
+            rate = 1;
+        }
+    }
+    return rate;
+}
+
+/* function to check if |h or |d values of the slot go into histogram. Name should match rule with
+ * bins and histogram output should fit into one packet, otherwise values are kept as is.
+ */
+int is_histogram(struct slot_table_s *table, slot_s *slot) {
+    if (slot->type != TYPE_UNKNOWN) {
+        return slot->type == TYPE_HISTOGRAM;
+    }
+    return slot->rule != NULL && slot->rule->bins_num > 0 && histogram_length(slot->rule, slot->name_length, table->suffix_length) <= DOWNSTREAM_BUF_SIZE;
+}
+
+/* function to check if timer values of the slot are sampled. Name should match rule with max_samples
+ * and output of all kept values should fit into one packet, otherwise values are kept as is.
+ */
+int is_sampled(struct slot_table_s *table, slot_s *slot) {
+    if (slot->type != TYPE_UNKNOWN) {
+        return slot->type == TYPE_SAMPLED;
+    }
+    return slot->rule != NULL && slot->rule->max_samples > 0 &&
+        slot->name_length + slot->rule->max_samples * (MAX_SAMPLE_LENGTH + table->suffix_length) <= DOWNSTREAM_BUF_SIZE;
+}
+
+/* function to add timer value to reservoir of the slot. First max_samples values are kept, after that
+ * n-th value replaces random kept one with probability max_samples / n, so every value of the interval
+ * has the same chance to be sent. Number of values seen is kept in counter of the slot.
+ */
+void add_sample(struct slot_table_s *table, slot_s *slot, double value, double rate) {
+    sample_s *samples = slot_values(slot);
+    long seen = ++slot->counter;
+    long idx = seen - 1;
+
+    if (seen > slot->rule->max_samples) {
+        idx = random() % seen;
+        if (idx >= slot->rule->max_samples) {
+            return;
+        }
+    } else {
+        // output space is taken by every kept value, replacements don't need more
+        slot->length += MAX_SAMPLE_LENGTH + table->suffix_length;
+        table->length += MAX_SAMPLE_LENGTH + table->suffix_length;
+    }
+    samples[idx].value = value;
+    samples[idx].rate = rate;
+}
+
+/* function to write value rounded to configured number of significant digits or resolution in
+ * the shortest form, returns length of the result
+ */
+int format_quantized(char *target, double value, struct rule_s *rule) {
+    char plain[32];
+    int plain_length = 0;
+    int length = 0;
+
+    if (rule->quantize_digits > 0) {
+        length = sprintf(target, "%.*g", rule->quantize_digits, value);
+        // large values like 1.23e+06 are shorter without exponent
+        if (memchr(target, 'e', length) != NULL && fabs(value) < 1e15) {
+            plain_length = sprintf(plain, "%.0f", strtod(target, NULL));
+            if (plain_length < length) {
+                length = plain_length;
+                memcpy(target, plain, length);
             }
         }
+    } else {
+        // %.15g hides binary representation error of the multiplication, adding 0 turns -0 into 0
+        length = sprintf(target, "%.15g", round(value / rule->quantize_step) * rule->quantize_step + 0.0);
+    }
+    return length;
+}
+
+// function to check if values of the type are rounded for the rule, type is like "ms|@0.5"
+int is_quantized(struct rule_s *rule, char *type) {
+    return rule != NULL && (rule->quantize_digits > 0 || rule->quantize_step > 0) && (type[0] == 'm' || type[0] == 'h' || type[0] == 'd');
+}
+
+/* function to round value like "23.4817|ms|@0.5", result is rounded value followed by the rest of
+ * the value data. Returns length of the result, 0 if value is not a number and should be kept as is.
+ */
+int quantize_value(char *target, char *buffer_ptr, char *type_ptr, int data_length, struct rule_s *rule) {
+    char *endptr = NULL;
+    double value = 0;
+    int length = 0;
+
+    errno = 0;
+    value = strtod(buffer_ptr, &endptr);
+    if (errno != 0 || endptr != type_ptr || ! isfinite(value)) {
+        return 0;
+    }
+    length = format_quantized(target, value, rule);
+    memcpy(target + length, type_ptr, data_length - (type_ptr - buffer_ptr));
+    return length + data_length - (type_ptr - buffer_ptr);
+}
+
+/* function to get type value would have in the slot, type is like "ms|@0.5". Rule of the slot is
+ * looked up once, when slot gets its type.
+ */
+int value_type(struct slot_table_s *table, slot_s *slot, char *type) {
+    if (slot->type == TYPE_UNKNOWN && global.rules_num > 0) {
+        slot->rule = find_rule(slot->buffer, slot->name_length);
+    }
+    if (type[0] == 'c') {
+        return TYPE_COUNTER;
+    } else if ((type[0] == 'h' || type[0] == 'd') && is_histogram(table, slot)) {
+        return TYPE_HISTOGRAM;
+    } else if (type[0] == 'm' && type[1] == 's' && is_sampled(table, slot)) {
+        return TYPE_SAMPLED;
+    }
+    return TYPE_OTHER;
+}
+
+/* function to check if value of the type can be added to the slot: values kept as is are shed under
+ * memory pressure and all values of the slot should have the same type. Slot gets type of its first value.
+ */
+int accept_value(slot_s *slot, int metric_type) {
+    if (metric_type == TYPE_OTHER && global.memory.pressure == MEMORY_PRESSURE_SHED) {
+        global.stats.values_shed++;
+        return 0;
+    }
+    if (slot->type == TYPE_UNKNOWN) {
+        slot->type = metric_type;
+    } else if (slot->type != metric_type) {
+        log_msg(ERROR, "%s: got improper metric type for \"%.*s\"", __func__, slot->name_length, slot->buffer);
+        return 0;
+    }
+    return 1;
+}
+
+/* function to get maximum length value adds to the output, data_length is length of value kept as is.
+ * If metric is counter let's use maximum possible length of resulting string (because of "%.15g|c\n"),
+ * histogram takes its fixed output length with the first value, sampled slot with every kept value.
+ */
+int value_output_length(struct slot_table_s *table, slot_s *slot, int data_length) {
+    if (slot->type == TYPE_COUNTER) {
+        return MAX_COUNTER_LENGTH + table->suffix_length;
+    } else if (slot->type == TYPE_SAMPLED) {
+        return slot->counter < slot->rule->max_samples ? MAX_SAMPLE_LENGTH + table->suffix_length : 0;
+    } else if (slot->type == TYPE_HISTOGRAM) {
+        return slot->length == slot->name_length ? histogram_length(slot->rule, slot->name_length, table->suffix_length) - slot->name_length : 0;
+    }
+    return data_length + table->suffix_length;
+}
+
+/* function to make sure value_length more bytes fit into the output, otherwise table is flushed and
+ * name gets new slot of the same type, name is copied from the old slot. Returns index of the slot
+ * value should go to.
+ */
+int reserve_value(struct slot_table_s *table, int slot_idx, int value_length) {
+    slot_s *slot = table->slots + slot_idx;
+    int name_length = slot->name_length;
+    uint32_t hash = slot->hash;
+    struct rule_s *rule = slot->rule;
+    int type = slot->type;
+
+    if (table->length + value_length <= DOWNSTREAM_BUF_SIZE) {
+        return slot_idx;
+    }
+    downstream_schedule_flush(table);
+    slot_idx = add_slot(table, slot->buffer, name_length, hash);
+    table->slots[slot_idx].type = type;
+    table->slots[slot_idx].rule = rule;
+    return slot_idx;
+}
+
+// function to write value same as "%.15g" does, integers are written without sprintf
+int format_double(char *target, double value) {
+    char digits[16];
+    uint64_t n = 0;
+    int length = 0;
+    int i = 0;
+
+    // -0 is written by sprintf as "-0"
+    if (! (fabs(value) < 1e15) || value != (int64_t)value || (value == 0 && signbit(value))) {
+        return sprintf(target, "%.15g", value);
+    }
+    if (value < 0) {
+        target[length++] = '-';
+    }
+    n = fabs(value);
+    do {
+        digits[i++] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    while (i > 0) {
+        target[length++] = digits[--i];
+    }
+    return length;
+}
+
+// function to add counter delta to the slot, counter has single value, so suffix is accounted once
+void add_counter(struct slot_table_s *table, slot_s *slot, double counter) {
+    char *counter_ptr = slot->buffer + slot->name_length;
+    int counter_len = 0;
+
+    slot->counter += counter;
+    counter_len = format_double(counter_ptr, slot->counter);
+    memcpy(counter_ptr + counter_len, "|c\n", 3);
+    counter_len += 3;
+    if (slot->length == slot->name_length) {
+        table->length += table->suffix_length;
     }
-    if (global.downstream.active_buffer_length + name_length > DOWNSTREAM_BUF_SIZE) {
-        log_msg(TRACE, "%s: active_buffer_length = %d, name_length = %d, scheduling flush", __func__, global.downstream.active_buffer_length, name_length);
-        downstream_schedule_flush();
+    table->length -= slot->length;
+    slot->length = slot->name_length + counter_len;
+    table->length += slot->length;
+    log_msg(TRACE, "%s: counter delta = %.15g, counter value = %.15g", __func__, counter, slot->counter);
+}
+
+// function to count value in its histogram bin, bins are cleared and output length is taken with the first value
+void add_histogram_value(struct slot_table_s *table, slot_s *slot, double value, double rate) {
+    double *counts = slot_values(slot);
+
+    if (slot->length == slot->name_length) {
+        memset(counts, 0, sizeof(double) * slot->rule->bins_num);
+        slot->length = histogram_length(slot->rule, slot->name_length, table->suffix_length);
+        table->length += slot->length - slot->name_length;
     }
-    return add_slot(line, name_length);
+    counts[histogram_bin(slot->rule, value)] += 1 / rate;
+}
+
+// function to append value kept as is to the slot, data ends with delimiter which is replaced by ':'
+void append_value(struct slot_table_s *table, slot_s *slot, char *data, int data_length) {
+    memcpy(slot->buffer + slot->length, data, data_length);
+    slot->buffer[slot->length + data_length - 1] = ':';
+    slot->length += data_length;
+    table->length += data_length + table->suffix_length;
 }
 
-void insert_values_into_slot(int initial_slot_idx, char *line, char *colon_ptr, int length) {
+void insert_values_into_slot(struct slot_table_s *table, int initial_slot_idx, char *line, char *colon_ptr, int length) {
     int slot_idx = initial_slot_idx;
     ssize_t bytes_in_buffer;
     char *buffer_ptr = colon_ptr + 1;
     char *delimiter_ptr = colon_ptr;
-    char *target_ptr = NULL;
     int data_length = 0;
-    int name_length = global.downstream.slots[slot_idx].name_length;
     char *type_ptr = NULL;
     int metric_type = 0;
     double counter = 0;
-    char *counter_ptr = NULL;
-    int counter_len = 0;
     char *endptr = NULL;
-    char *rate_ptr = NULL;
+    slot_s *slot = NULL;
     double rate = 1;
+    double value = 0;
+    char quantized[DATA_BUF_SIZE];
+    char *data_ptr = NULL;
+    int copy_length = 0;
 
     bytes_in_buffer = length - (colon_ptr - line) - 1;
     log_msg(TRACE, "%s: metrics data \"%.*s\"", __func__, (int)bytes_in_buffer, colon_ptr);
@@ -343,147 +1304,1151 @@ void insert_values_into_slot(int initial_slot_idx, char *line, char *colon_ptr,
             buffer_ptr += data_length;
             continue;
         }
-        metric_type = TYPE_OTHER;
-        if (*(type_ptr + 1) == 'c') {
-            metric_type = TYPE_COUNTER;
+        slot = table->slots + slot_idx;
+        metric_type = value_type(table, slot, type_ptr + 1);
+        if (! accept_value(slot, metric_type)) {
+            bytes_in_buffer -= data_length;
+            buffer_ptr += data_length;
+            continue;
         }
-        if (global.downstream.slots[slot_idx].type == TYPE_UNKNOWN) {
-            global.downstream.slots[slot_idx].type = metric_type;
-        } else {
-            if (global.downstream.slots[slot_idx].type != metric_type) {
-                log_msg(ERROR, "%s: got improper metric type for \"%.*s\"", __func__, global.downstream.slots[slot_idx].name_length, global.downstream.slots[slot_idx].buffer);
-                bytes_in_buffer -= data_length;
-                buffer_ptr += data_length;
-                continue;
+        data_ptr = buffer_ptr;
+        copy_length = data_length;
+        if ((metric_type == TYPE_OTHER || metric_type == TYPE_SAMPLED) && is_quantized(slot->rule, type_ptr + 1)) {
+            copy_length = quantize_value(quantized, buffer_ptr, type_ptr, data_length, slot->rule);
+            if (copy_length > 0) {
+                data_ptr = quantized;
+            } else {
+                copy_length = data_length;
             }
         }
-        // if metric is counter let's use maximum possible length of resulting string (because of "%.15g|c\n" below)
-        if (global.downstream.active_buffer_length + (metric_type == TYPE_COUNTER ? MAX_COUNTER_LENGTH : data_length) > DOWNSTREAM_BUF_SIZE) {
-            downstream_schedule_flush();
-            slot_idx = add_slot(line, name_length);
-            global.downstream.slots[slot_idx].type = metric_type;
-        }
-        target_ptr = global.downstream.slots[slot_idx].buffer + global.downstream.slots[slot_idx].length;
-        log_msg(TRACE, "%s: adding \"%.*s\"", __func__, data_length, buffer_ptr);
-        if (metric_type == TYPE_COUNTER) {
-            rate = 1;
-            rate_ptr = memchr(type_ptr + 1, '|', data_length - (type_ptr - buffer_ptr));
-            if (rate_ptr != NULL && *(rate_ptr + 1) == '@') {
-                errno = 0;
-                rate = strtod(rate_ptr + 2, &endptr);
-                if (errno != 0 || (endptr + 1) != (buffer_ptr + data_length)) {
-                    log_msg(TRACE, "%s: invalid rate in counter data \"%.*s\"", __func__, data_length - 1, buffer_ptr);
-                    rate = 1;
-                }
+        slot_idx = reserve_value(table, slot_idx, value_output_length(table, slot, copy_length));
+        slot = table->slots + slot_idx;
+        log_msg(TRACE, "%s: adding \"%.*s\"", __func__, copy_length, data_ptr);
+        if (metric_type == TYPE_HISTOGRAM) {
+            errno = 0;
+            value = strtod(buffer_ptr, &endptr);
+            if (errno != 0 || endptr != type_ptr || isnan(value)) {
+                log_msg(ERROR, "%s: invalid value in histogram data \"%.*s\"", __func__, data_length - 1, buffer_ptr);
+            } else {
+                add_histogram_value(table, slot, value, value_rate(buffer_ptr, type_ptr, data_length));
+            }
+        } else if (metric_type == TYPE_SAMPLED) {
+            // value could be rounded, so it ends where its type starts in the copied data
+            errno = 0;
+            value = strtod(data_ptr, &endptr);
+            if (errno != 0 || endptr != data_ptr + copy_length - data_length + (type_ptr - buffer_ptr) || ! isfinite(value)) {
+                log_msg(ERROR, "%s: invalid value in timer data \"%.*s\"", __func__, data_length - 1, buffer_ptr);
+            } else {
+                add_sample(table, slot, value, value_rate(buffer_ptr, type_ptr, data_length));
             }
+        } else if (metric_type == TYPE_COUNTER) {
+            rate = value_rate(buffer_ptr, type_ptr, data_length);
             errno = 0;
             counter = strtod(buffer_ptr, &endptr) / rate;
             if (errno != 0 || endptr != type_ptr) {
                 log_msg(ERROR, "%s: invalid value in counter data \"%.*s\"", __func__, data_length - 1, buffer_ptr);
             } else {
-                counter_ptr = global.downstream.slots[slot_idx].buffer + name_length;
-                global.downstream.slots[slot_idx].counter += counter;
-                counter_len = sprintf(counter_ptr, "%.15g|c\n", global.downstream.slots[slot_idx].counter);
-                global.downstream.active_buffer_length -= global.downstream.slots[slot_idx].length;
-                global.downstream.slots[slot_idx].length = global.downstream.slots[slot_idx].name_length + counter_len;
-                global.downstream.active_buffer_length += global.downstream.slots[slot_idx].length;
-                log_msg(TRACE, "%s: counter delta = %.15g, counter value = %.15g", __func__, counter, global.downstream.slots[slot_idx].counter);
+                add_counter(table, slot, counter);
             }
         } else {
-            memcpy(target_ptr, buffer_ptr, data_length);
-            target_ptr += data_length;
-            *(target_ptr - 1) = ':';
-            global.downstream.slots[slot_idx].length += data_length;
-            global.downstream.active_buffer_length += data_length;
+            append_value(table, slot, data_ptr, copy_length);
         }
         bytes_in_buffer -= data_length;
         buffer_ptr += data_length;
     }
-    log_msg(TRACE, "%s: buffer after insert: \"%.*s\"", __func__, global.downstream.slots[slot_idx].length, global.downstream.slots[slot_idx].buffer);
+    log_msg(TRACE, "%s: buffer after insert: \"%.*s\"", __func__, table->slots[slot_idx].length, table->slots[slot_idx].buffer);
 }
 
-// function to process single metrics line
-int process_data_line(char *line, int length) {
-    int slot_idx = -1;
-    char *colon_ptr = memchr(line, ':', length);
-    // if ':' wasn't found this is not valid statsd metric
-    if (colon_ptr == NULL) {
-        *(line + length - 1) = 0;
-        log_msg(ERROR, "%s: invalid metric %s", __func__, line);
-        return 1;
-    }
-    slot_idx = find_slot(line, colon_ptr - line + 1);
-    insert_values_into_slot(slot_idx, line, colon_ptr, length);
-    return 0;
+uint64_t load_u64(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
 }
 
-void udp_read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
-    char buffer[DATA_BUF_SIZE];
-    ssize_t bytes_in_buffer;
-    char *buffer_ptr = buffer;
-    char *delimiter_ptr = buffer;
-    int line_length = 0;
+uint64_t rotl64(uint64_t v, int r) {
+    return (v << r) | (v >> (64 - r));
+}
 
-    if (EV_ERROR & revents) {
-        log_msg(ERROR, "%s: invalid event %s", __func__, strerror(errno));
-        return;
-    }
+// final avalanche (murmur3 fmix64), slot index uses low bits so all input bits should affect them
+uint32_t name_hash_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (uint32_t)h;
+}
 
-    bytes_in_buffer = recv(watcher->fd, buffer, DATA_BUF_SIZE - 1, 0);
+// portable implementation: two independent multiply-rotate lanes, 8 bytes each
+int name_hash_portable_supported() {
+    return 1;
+}
+
+void name_hash_portable_init(name_hash_state_s *state) {
+    state->a = 0x9e3779b97f4a7c15ULL;
+    state->b = 0xc2b2ae3d27d4eb4fULL;
+}
+
+void name_hash_portable_block(name_hash_state_s *state, const char *block) {
+    state->a = rotl64((state->a ^ load_u64(block)) * 0x87c37b91114253d5ULL, 31);
+    state->b = rotl64((state->b ^ load_u64(block + 8)) * 0x4cf5ad432745937fULL, 29);
+}
+
+uint32_t name_hash_portable_finish(name_hash_state_s *state, const char *tail, int tail_length, int length) {
+    char block[NAME_HASH_BLOCK_SIZE] = {0};
+
+    memcpy(block, tail, tail_length);
+    name_hash_portable_block(state, block);
+    return name_hash_mix(state->a ^ rotl64(state->b, 17) ^ length);
+}
+
+uint32_t name_hash_portable(const char *name, int length) {
+    name_hash_state_s state;
+    int i = 0;
+
+    name_hash_portable_init(&state);
+    for (i = 0; i + NAME_HASH_BLOCK_SIZE <= length; i += NAME_HASH_BLOCK_SIZE) {
+        name_hash_portable_block(&state, name + i);
+    }
+    return name_hash_portable_finish(&state, name + i, length - i, length);
+}
+
+#if defined(__x86_64__)
+// sse4.2 implementation: two independent crc32c lanes, crc32 instruction has latency 3 and throughput 1
+int name_hash_crc32c_supported() {
+    return __builtin_cpu_supports("sse4.2");
+}
+
+void name_hash_crc32c_init(name_hash_state_s *state) {
+    state->a = 0xffffffff;
+    state->b = 0x9e3779b9;
+}
+
+__attribute__((target("sse4.2")))
+void name_hash_crc32c_block(name_hash_state_s *state, const char *block) {
+    state->a = _mm_crc32_u64(state->a, load_u64(block));
+    state->b = _mm_crc32_u64(state->b, load_u64(block + 8));
+}
+
+__attribute__((target("sse4.2")))
+uint32_t name_hash_crc32c_finish(name_hash_state_s *state, const char *tail, int tail_length, int length) {
+    char block[NAME_HASH_BLOCK_SIZE] = {0};
+
+    memcpy(block, tail, tail_length);
+    name_hash_crc32c_block(state, block);
+    // crc is linear, so it is mixed to get good low bits
+    return name_hash_mix(((state->a << 32) | state->b) ^ length);
+}
+
+__attribute__((target("sse4.2")))
+uint32_t name_hash_crc32c(const char *name, int length) {
+    name_hash_state_s state;
+    int i = 0;
+
+    name_hash_crc32c_init(&state);
+    for (i = 0; i + NAME_HASH_BLOCK_SIZE <= length; i += NAME_HASH_BLOCK_SIZE) {
+        name_hash_crc32c_block(&state, name + i);
+    }
+    return name_hash_crc32c_finish(&state, name + i, length - i, length);
+}
+
+// aes-ni implementation: every block is mixed into the state with one aes round
+int name_hash_aes_supported() {
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse4.1");
+}
+
+void name_hash_aes_init(name_hash_state_s *state) {
+    state->a = 0x243f6a8885a308d3ULL;
+    state->b = 0x13198a2e03707344ULL;
+}
+
+__attribute__((target("aes,sse4.1")))
+void name_hash_aes_block(name_hash_state_s *state, const char *block) {
+    __m128i s = _mm_loadu_si128((__m128i *)state);
+    __m128i key = _mm_set_epi64x(0xa4093822299f31d0ULL, 0x082efa98ec4e6c89ULL);
+
+    s = _mm_aesenc_si128(_mm_xor_si128(s, _mm_loadu_si128((__m128i *)block)), key);
+    _mm_storeu_si128((__m128i *)state, s);
+}
+
+__attribute__((target("aes,sse4.1")))
+uint32_t name_hash_aes_finish(name_hash_state_s *state, const char *tail, int tail_length, int length) {
+    char block[NAME_HASH_BLOCK_SIZE] = {0};
+    __m128i s;
+
+    memcpy(block, tail, tail_length);
+    name_hash_aes_block(state, block);
+    s = _mm_loadu_si128((__m128i *)state);
+    // two more rounds to spread last block over the whole state
+    s = _mm_aesenc_si128(s, _mm_set_epi64x(0x452821e638d01377ULL, length));
+    s = _mm_aesenc_si128(s, _mm_set_epi64x(0xbe5466cf34e90c6cULL, 0xc0ac29b7c97c50ddULL));
+    return (uint32_t)(_mm_cvtsi128_si64(s) ^ _mm_extract_epi64(s, 1));
+}
+
+__attribute__((target("aes,sse4.1")))
+uint32_t name_hash_aes(const char *name, int length) {
+    name_hash_state_s state;
+    int i = 0;
+
+    name_hash_aes_init(&state);
+    for (i = 0; i + NAME_HASH_BLOCK_SIZE <= length; i += NAME_HASH_BLOCK_SIZE) {
+        name_hash_aes_block(&state, name + i);
+    }
+    return name_hash_aes_finish(&state, name + i, length - i, length);
+}
+#endif
+
+// implementations in order of preference, the first supported one is used by default
+struct name_hasher_s name_hashers[] = {
+#if defined(__x86_64__)
+    { "crc32c", name_hash_crc32c_supported, name_hash_crc32c_init, name_hash_crc32c_block, name_hash_crc32c_finish, name_hash_crc32c },
+    { "aes", name_hash_aes_supported, name_hash_aes_init, name_hash_aes_block, name_hash_aes_finish, name_hash_aes },
+#endif
+    { "portable", name_hash_portable_supported, name_hash_portable_init, name_hash_portable_block, name_hash_portable_finish, name_hash_portable },
+    { NULL }
+};
+
+// function to select name hasher, name "auto" means the best one supported by cpu
+int init_name_hasher(char *name) {
+    struct name_hasher_s *hasher = NULL;
+
+    __builtin_cpu_init();
+    for (hasher = name_hashers; hasher->name != NULL; hasher++) {
+        if (strcmp(name, "auto") != 0 && strcmp(name, hasher->name) != 0) {
+            continue;
+        }
+        if (hasher->supported()) {
+            global.name_hasher = hasher;
+            log_msg(INFO, "%s: using %s name hashing", __func__, hasher->name);
+            return 0;
+        }
+        log_msg(ERROR, "%s: %s name hashing is not supported by cpu", __func__, hasher->name);
+        return 1;
+    }
+    log_msg(ERROR, "%s: unknown name hashing \"%s\"", __func__, name);
+    return 1;
+}
+
+// function to fill sanitize table, it follows statsd rules: whitespace is replaced with '_',
+// '/' with '-' and everything except letters, digits, '_', '-' and '.' is removed
+void init_sanitize_table() {
+    int c = 0;
+
+    for (c = 0; c < 256; c++) {
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-' || c == '.') {
+            global.sanitize_table[c] = c;
+        } else if (c == '/') {
+            global.sanitize_table[c] = '-';
+        } else if (c == ' ' || (c >= '\t' && c <= '\r')) {
+            global.sanitize_table[c] = SANITIZE_SPACE;
+        } else {
+            global.sanitize_table[c] = 0;
+        }
+    }
+}
+
+/* this function sanitizes metric name in place and hashes the result in the same pass,
+ * returns new name length. Every 16 bytes written are final, so they are hashed right away.
+ */
+int sanitize_name(char *name, int length, uint32_t *hash) {
+    struct name_hasher_s *hasher = global.name_hasher;
+    name_hash_state_s state;
+    char *target_ptr = name;
+    char *block_ptr = name;
+    unsigned char c = 0;
+    int space = 0;
+    int i = 0;
+
+    hasher->init(&state);
+    for (i = 0; i < length; i++) {
+        c = global.sanitize_table[(unsigned char)name[i]];
+        if (c == SANITIZE_SPACE) {
+            if (space == 0) {
+                *target_ptr++ = '_';
+            }
+            space = 1;
+        } else {
+            space = 0;
+            *target_ptr = c;
+            target_ptr += (c != 0);
+        }
+        if (target_ptr - block_ptr == NAME_HASH_BLOCK_SIZE) {
+            hasher->block(&state, block_ptr);
+            block_ptr = target_ptr;
+        }
+    }
+    *hash = hasher->finish(&state, block_ptr, target_ptr - block_ptr, target_ptr - name);
+    return target_ptr - name;
+}
 
-    if (bytes_in_buffer < 0) {
-        log_msg(ERROR, "%s: read() failed %s", __func__, strerror(errno));
+// function to parse id of line like "#12:1|c", name and its hash are taken from the alias later
+void prepare_alias_line(line_s *l) {
+    char *ptr = l->line + 1;
+    int id = 0;
+
+    while (ptr < l->colon_ptr && *ptr >= '0' && *ptr <= '9' && id < MAX_ALIASES) {
+        id = id * 10 + *ptr++ - '0';
+    }
+    if (ptr == l->line + 1 || ptr != l->colon_ptr || id >= MAX_ALIASES) {
+        l->error = LINE_INVALID_METRIC;
         return;
     }
+    l->alias = id;
+}
+
+// function to prepare single metrics line for slot lookup: finds name, sanitizes and hashes it
+void prepare_data_line(line_s *l) {
+    char first = 0;
 
-    if (bytes_in_buffer > 0) {
-        if (buffer[bytes_in_buffer - 1] != '\n') {
-            buffer[bytes_in_buffer++] = '\n';
+    l->alias = -1;
+    l->colon_ptr = memchr(l->line, ':', l->length);
+    // if ':' wasn't found this is not valid statsd metric
+    if (l->colon_ptr == NULL) {
+        l->error = LINE_INVALID_METRIC;
+        return;
+    }
+    if (l->line[0] == '#' && global.aliases.names != NULL) {
+        prepare_alias_line(l);
+        return;
+    }
+    l->name_length = l->colon_ptr - l->line;
+    if (global.sanitize_names) {
+        // name can only get shorter, so sanitized name followed by ':' stays within the line
+        first = l->line[0];
+        l->name_length = sanitize_name(l->line, l->name_length, &(l->hash));
+        // only the first byte is overwritten if nothing is left of the name, line is logged as it came
+        if (l->name_length == 0) {
+            l->line[0] = first;
+            l->error = LINE_INVALID_METRIC;
+            return;
+        }
+        l->line[l->name_length] = ':';
+    } else {
+        l->hash = global.name_hasher->hash(l->line, l->name_length);
+    }
+    // from now on name includes ':'
+    l->name_length++;
+}
+
+/* function to remove DogStatsD style timestamps (|T<unix time>) from values of the line, returns
+ * timestamp of the first value or -1 if there are none. Values are not split between intervals,
+ * lines with timestamps from different intervals are counted.
+ */
+long strip_timestamps(line_s *l) {
+    char *end_ptr = l->line + l->length;
+    char *read_ptr = l->colon_ptr;
+    char *write_ptr = l->colon_ptr;
+    char *timestamp_ptr = l->colon_ptr;
+    char *endptr = NULL;
+    long timestamp = -1;
+    long value = 0;
+    int mixed = 0;
+
+    while ((timestamp_ptr = memmem(timestamp_ptr, end_ptr - timestamp_ptr, "|T", 2)) != NULL) {
+        timestamp_ptr += 2;
+        // line ends with '\n', so strtol() stops within the line
+        value = strtol(timestamp_ptr, &endptr, 10);
+        if (*timestamp_ptr < '0' || *timestamp_ptr > '9' || (*endptr != ':' && *endptr != '|' && *endptr != '\n')) {
+            continue;
+        }
+        memmove(write_ptr, read_ptr, timestamp_ptr - 2 - read_ptr);
+        write_ptr += timestamp_ptr - 2 - read_ptr;
+        read_ptr = endptr;
+        timestamp_ptr = endptr;
+        if (timestamp < 0) {
+            timestamp = value;
+        } else if ((long)(value / global.downstream_flush_interval) != (long)(timestamp / global.downstream_flush_interval)) {
+            mixed = 1;
+        }
+    }
+    if (mixed) {
+        log_msg(DEBUG, "%s: values of %.*s are from different intervals, using timestamp %ld", __func__,
+            (int)(l->colon_ptr - l->line), l->line, timestamp);
+        global.lateness.mixed_intervals++;
+    }
+    if (write_ptr != read_ptr) {
+        memmove(write_ptr, read_ptr, end_ptr - read_ptr);
+        l->length -= read_ptr - write_ptr;
+    }
+    return timestamp;
+}
+
+/* function to find table of the lateness window for the timestamp, returns NULL if timestamp is
+ * in the future or older than the window. Table still holding data of the expired interval is
+ * flushed before it is reused.
+ */
+struct slot_table_s *lateness_window_table(long timestamp) {
+    long interval = timestamp / global.downstream_flush_interval;
+    long current = clock_now() / global.downstream_flush_interval;
+    struct slot_table_s *table = NULL;
+
+    if (interval > current || interval <= current - global.lateness.window) {
+        log_msg(DEBUG, "%s: timestamp %ld is out of the lateness window", __func__, timestamp);
+        global.lateness.out_of_window++;
+        return NULL;
+    }
+    table = global.lateness.tables + interval % global.lateness.window;
+    if (table->interval != interval) {
+        if (table->length > 0) {
+            downstream_schedule_flush(table);
         }
-        log_msg(TRACE, "%s: got packet %.*s", __func__, bytes_in_buffer, buffer);
-        while ((delimiter_ptr = memchr(buffer_ptr, '\n', bytes_in_buffer)) != NULL) {
-            delimiter_ptr++;
-            line_length = delimiter_ptr - buffer_ptr;
-            // minimum metrics line should look like X:1|c\n
-            // so lines with length less than 6 can be ignored
-            // if we've got counter like 1|c|@0.3 it would expand to 3.33333333333|c
-            // so to be on safe side let's limit maximum line length so that we would be able to fit counter in any case
-            if (line_length > 6 && line_length < (DOWNSTREAM_BUF_SIZE - MAX_COUNTER_LENGTH)) {
-                // if line has valid length let's process it
-                process_data_line(buffer_ptr, line_length);
+        table->interval = interval;
+        table->suffix_length = snprintf(table->suffix, TIMESTAMP_SUFFIX_SIZE, "|T%ld", (long)(interval * global.downstream_flush_interval));
+    }
+    return table;
+}
+
+// function to flush tables of the lateness window that are older than the window
+void flush_lateness_window() {
+    long current = clock_now() / global.downstream_flush_interval;
+    struct slot_table_s *table = NULL;
+    int i = 0;
+
+    for (i = 0; i < global.lateness.window; i++) {
+        table = global.lateness.tables + i;
+        if (table->length > 0 && table->interval <= current - global.lateness.window) {
+            downstream_schedule_flush(table);
+        }
+    }
+}
+
+// function to count line refused because of memory pressure in the overflow metric
+void count_refused_line() {
+    static char line[] = OVERFLOW_METRIC_LINE;
+    struct slot_table_s *table = &(global.downstream.slot_table);
+    uint32_t hash = global.name_hasher->hash(line, OVERFLOW_METRIC_NAME_LENGTH);
+    int slot_idx = find_slot(table, line, OVERFLOW_METRIC_NAME_LENGTH + 1, hash);
+
+    insert_values_into_slot(table, slot_idx, line, line + OVERFLOW_METRIC_NAME_LENGTH, STRLEN(OVERFLOW_METRIC_LINE));
+    global.stats.names_refused++;
+}
+
+// function to find or create slot for the name, under memory pressure only names that already have slots are aggregated
+int get_slot(struct slot_table_s *table, char *line, int name_length, uint32_t hash) {
+    int slot_idx = -1;
+
+    if (global.memory.pressure >= MEMORY_PRESSURE_REFUSE) {
+        slot_idx = lookup_slot(table, line, name_length, hash);
+        if (slot_idx < 0) {
+            count_refused_line();
+        }
+        return slot_idx;
+    }
+    return find_slot(table, line, name_length, hash);
+}
+
+/* function to get slot of the alias by direct index, slot is cached until the table is reset, so
+ * the name is looked up (with the hash computed on registration) once per flush
+ */
+int alias_slot(struct slot_table_s *table, int id) {
+    struct alias_s *alias = global.aliases.names + id;
+
+    if (alias->name == NULL) {
+        log_msg(ERROR, "%s: unknown alias %d", __func__, id);
+        global.aliases.unknown++;
+        return -1;
+    }
+    if (alias->table != table || alias->generation != table->generation) {
+        alias->slot_idx = get_slot(table, alias->name, alias->name_length, alias->hash);
+        if (alias->slot_idx < 0) {
+            return -1;
+        }
+        alias->table = table;
+        alias->generation = table->generation;
+    }
+    return alias->slot_idx;
+}
+
+// function to process single prepared metrics line
+int process_data_line(line_s *l) {
+    struct slot_table_s *table = &(global.downstream.slot_table);
+    long timestamp = -1;
+    int slot_idx = -1;
+    int length = 0;
+
+    if (l->error == LINE_INVALID_LENGTH) {
+        log_msg(ERROR, "%s: invalid length %d of metric %.*s", __func__, l->length - 1, l->length - 1, l->line);
+        return 1;
+    }
+    if (l->error == LINE_INVALID_METRIC) {
+        *(l->line + l->length - 1) = 0;
+        log_msg(ERROR, "%s: invalid metric %s", __func__, l->line);
+        return 1;
+    }
+    if (l->alias >= 0) {
+        // length was checked with the id, line with the registered name should fit the same limit
+        length = global.aliases.names[l->alias].name_length - 1 + l->length - (l->colon_ptr - l->line);
+        if (length >= (DOWNSTREAM_BUF_SIZE - MAX_COUNTER_LENGTH)) {
+            log_msg(ERROR, "%s: invalid length %d of metric %.*s", __func__, length - 1, l->length - 1, l->line);
+            return 1;
+        }
+    }
+    if (global.lateness.window > 0 && (timestamp = strip_timestamps(l)) >= 0) {
+        table = lateness_window_table(timestamp);
+        if (table == NULL) {
+            return 1;
+        }
+    }
+    if (l->alias >= 0) {
+        slot_idx = alias_slot(table, l->alias);
+    } else {
+        slot_idx = get_slot(table, l->line, l->name_length, l->hash);
+    }
+    if (slot_idx < 0) {
+        return 1;
+    }
+    insert_values_into_slot(table, slot_idx, l->line, l->colon_ptr, l->length);
+    return 0;
+}
+
+// function to decode little endian double of binary record
+double binary_double(char *ptr) {
+    uint64_t bits = 0;
+    double value = 0;
+
+    memcpy(&bits, ptr, sizeof(bits));
+    bits = le64toh(bits);
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/* function to add value of binary record to the slot, it goes through the same steps as text value,
+ * only values kept as is are formatted. Type is like "ms".
+ */
+void insert_binary_value(struct slot_table_s *table, int slot_idx, char *type, double value, double rate) {
+    char data[MAX_BINARY_VALUE_LENGTH + 1];
+    slot_s *slot = table->slots + slot_idx;
+    int metric_type = value_type(table, slot, type);
+    int data_length = 0;
+
+    if (! isfinite(value)) {
+        log_msg(ERROR, "%s: invalid value in binary data of \"%.*s\"", __func__, slot->name_length, slot->buffer);
+        return;
+    }
+    if (! accept_value(slot, metric_type)) {
+        return;
+    }
+    if (metric_type == TYPE_SAMPLED && is_quantized(slot->rule, type)) {
+        format_quantized(data, value, slot->rule);
+        value = strtod(data, NULL);
+    } else if (metric_type == TYPE_OTHER) {
+        if (is_quantized(slot->rule, type)) {
+            data_length = format_quantized(data, value, slot->rule);
+        } else {
+            data_length = format_double(data, value);
+        }
+        data[data_length++] = '|';
+        data[data_length++] = type[0];
+        if (type[1] != 0) {
+            data[data_length++] = type[1];
+        }
+        if (rate != 1) {
+            data_length += sprintf(data + data_length, "|@%.15g", rate);
+        }
+        // delimiter is replaced by ':' in the slot
+        data[data_length++] = '\n';
+    }
+    slot_idx = reserve_value(table, slot_idx, value_output_length(table, slot, data_length));
+    slot = table->slots + slot_idx;
+    if (metric_type == TYPE_COUNTER) {
+        add_counter(table, slot, value / rate);
+    } else if (metric_type == TYPE_HISTOGRAM) {
+        add_histogram_value(table, slot, value, rate);
+    } else if (metric_type == TYPE_SAMPLED) {
+        add_sample(table, slot, value, rate);
+    } else {
+        append_value(table, slot, data, data_length);
+    }
+}
+
+// function to send binary record to the tap clients as the text line it stands for, alias gets registered name
+void tap_binary_record(char *prefix, int prefix_length, char *name, int name_length, int alias, char *type, double value, double rate) {
+    char line[DOWNSTREAM_BUF_SIZE];
+    int length = 0;
+
+    if (alias >= 0 && global.aliases.names[alias].name != NULL) {
+        length = snprintf(line, sizeof(line), "%.*s%.15g|%s", global.aliases.names[alias].name_length,
+            global.aliases.names[alias].name, value, type);
+    } else if (alias >= 0) {
+        length = snprintf(line, sizeof(line), "#%d:%.15g|%s", alias, value, type);
+    } else {
+        length = snprintf(line, sizeof(line), "%.*s%.*s:%.15g|%s", prefix_length, prefix, name_length, name, value, type);
+    }
+    if (rate != 1 && length < sizeof(line)) {
+        length += snprintf(line + length, sizeof(line) - length, "|@%.15g", rate);
+    }
+    // too long name is cut, tap_line() adds missing '\n'
+    if (length >= sizeof(line)) {
+        length = sizeof(line) - 1;
+    }
+    tap_line(TAP_IN, line, length);
+}
+
+// function to send alias line to the tap clients with registered name, so that filters by name prefix see it
+void tap_alias_line(line_s *l) {
+    char line[DOWNSTREAM_BUF_SIZE];
+    struct alias_s *alias = NULL;
+    int length = 0;
+
+    // lines with invalid or unknown id are sent as they came
+    if (l->error != 0 || global.aliases.names[l->alias].name == NULL) {
+        tap_line(TAP_IN, l->line, l->length);
+        return;
+    }
+    alias = global.aliases.names + l->alias;
+    length = snprintf(line, sizeof(line), "%.*s%.*s", alias->name_length - 1, alias->name,
+        (int)(l->line + l->length - l->colon_ptr), l->colon_ptr);
+    // too long name is cut, tap_line() adds missing '\n'
+    if (length >= sizeof(line)) {
+        length = sizeof(line) - 1;
+    }
+    tap_line(TAP_IN, line, length);
+}
+
+/* function to process binary datagram without its magic byte. Records are decoded into the same slot
+ * operations as text lines, without scanning for delimiters and parsing numbers. Prefix is prepended
+ * to every name.
+ */
+void process_binary_packet(char *prefix, int prefix_length, char *buffer, ssize_t bytes_in_buffer) {
+    char line[DOWNSTREAM_BUF_SIZE];
+    char type[3] = { 0, 0, 0 };
+    struct slot_table_s *table = &(global.downstream.slot_table);
+    char *buffer_ptr = buffer;
+    char *end_ptr = buffer + bytes_in_buffer;
+    char *value_ptr = NULL;
+    uint16_t length = 0;
+    int name_length = 0;
+    uint32_t hash = 0;
+    int slot_idx = 0;
+    int alias = -1;
+    double rate = 1;
+
+    memcpy(line, prefix, prefix_length);
+    while (buffer_ptr < end_ptr) {
+        if (end_ptr - buffer_ptr < sizeof(length)) {
+            log_msg(ERROR, "%s: truncated binary record at offset %d", __func__, (int)(buffer_ptr - buffer));
+            break;
+        }
+        memcpy(&length, buffer_ptr, sizeof(length));
+        length = le16toh(length);
+        alias = -1;
+        if ((length & BINARY_ALIAS_FLAG) && global.aliases.names != NULL) {
+            alias = length & ~BINARY_ALIAS_FLAG;
+            length = 0;
+        }
+        if (end_ptr - buffer_ptr < sizeof(length) + length + BINARY_VALUE_SIZE) {
+            log_msg(ERROR, "%s: truncated binary record at offset %d", __func__, (int)(buffer_ptr - buffer));
+            break;
+        }
+        value_ptr = buffer_ptr + sizeof(length) + length;
+        buffer_ptr = value_ptr + BINARY_VALUE_SIZE;
+        type[0] = *value_ptr;
+        type[1] = (type[0] == 'm') ? 's' : 0;
+        if (type[0] == 0 || strchr("cgshdm", type[0]) == NULL) {
+            log_msg(ERROR, "%s: invalid type '%c' in binary record", __func__, type[0]);
+            continue;
+        }
+        rate = binary_double(value_ptr + 1 + sizeof(double));
+        if (! (rate > 0) || ! isfinite(rate)) {
+            log_msg(TRACE, "%s: invalid rate %g in binary record", __func__, rate);
+            rate = 1;
+        }
+        if (global.tap.clients_ready > 0) {
+            tap_binary_record(prefix, prefix_length, value_ptr - length, length, alias, type, binary_double(value_ptr + 1), rate);
+        }
+        if (alias >= 0) {
+            slot_idx = alias_slot(table, alias);
+        } else {
+            name_length = prefix_length + length;
+            // same limit as for text line, so that any value fits into slot
+            if (length == 0 || name_length + 1 + MAX_BINARY_VALUE_LENGTH >= DOWNSTREAM_BUF_SIZE - MAX_COUNTER_LENGTH) {
+                log_msg(ERROR, "%s: invalid name length %d in binary record", __func__, name_length);
+                continue;
+            }
+            memcpy(line + prefix_length, value_ptr - length, length);
+            if (global.sanitize_names) {
+                name_length = sanitize_name(line, name_length, &hash);
+                if (name_length == 0) {
+                    log_msg(ERROR, "%s: name of binary record is empty after sanitizing", __func__);
+                    continue;
+                }
+            } else if (memchr(line, ':', name_length) != NULL || memchr(line, '\n', name_length) != NULL) {
+                log_msg(ERROR, "%s: invalid name \"%.*s\" in binary record", __func__, name_length, line);
+                continue;
             } else {
-                log_msg(ERROR, "%s: invalid length %d of metric %.*s", __func__, line_length - 1, line_length - 1, buffer_ptr);
+                hash = global.name_hasher->hash(line, name_length);
+            }
+            // from now on name includes ':'
+            line[name_length++] = ':';
+            slot_idx = get_slot(table, line, name_length, hash);
+        }
+        if (slot_idx >= 0) {
+            insert_binary_value(table, slot_idx, type, binary_double(value_ptr + 1), rate);
+        }
+    }
+    // under memory pressure data is not kept till the flush timer, output queue should be empty
+    // though, otherwise flushing every datagram overruns it
+    if (global.memory.pressure >= MEMORY_PRESSURE_FLUSH && global.downstream.slot_table.length > 0 &&
+            global.downstream.flush_buffer_idx == global.downstream.active_buffer_idx) {
+        downstream_schedule_flush(&(global.downstream.slot_table));
+    }
+}
+
+// function to process single datagram, buffer should have space for one extra byte
+void process_data_packet(char *buffer, ssize_t bytes_in_buffer) {
+    line_s l;
+    char *buffer_ptr = buffer;
+    char *delimiter_ptr = buffer;
+    int line_length = 0;
+    int alias_line = 0;
+
+    if ((unsigned char)buffer[0] == BINARY_MAGIC) {
+        process_binary_packet("", 0, buffer + 1, bytes_in_buffer - 1);
+        return;
+    }
+    if (buffer[bytes_in_buffer - 1] != '\n') {
+        buffer[bytes_in_buffer++] = '\n';
+    }
+    log_msg(TRACE, "%s: got packet %.*s", __func__, bytes_in_buffer, buffer);
+    while ((delimiter_ptr = memchr(buffer_ptr, '\n', bytes_in_buffer)) != NULL) {
+        delimiter_ptr++;
+        line_length = delimiter_ptr - buffer_ptr;
+        // alias lines are tapped once their id is parsed, other lines before sanitizing changes them
+        alias_line = buffer_ptr[0] == '#' && global.aliases.names != NULL;
+        if (global.tap.clients_ready > 0 && ! alias_line) {
+            tap_line(TAP_IN, buffer_ptr, line_length);
+        }
+        l.line = buffer_ptr;
+        l.length = line_length;
+        l.hash = 0;
+        l.error = 0;
+        // minimum metrics line should look like X:1|c\n
+        // so lines with length less than 6 can be ignored
+        // if we've got counter like 1|c|@0.3 it would expand to 3.33333333333|c
+        // so to be on safe side let's limit maximum line length so that we would be able to fit counter in any case
+        if (line_length <= 6 || line_length >= (DOWNSTREAM_BUF_SIZE - MAX_COUNTER_LENGTH)) {
+            l.error = LINE_INVALID_LENGTH;
+        } else {
+            prepare_data_line(&l);
+        }
+        if (global.tap.clients_ready > 0 && alias_line) {
+            tap_alias_line(&l);
+        }
+        process_data_line(&l);
+        // this is not last metric, let's advance line start pointer
+        buffer_ptr = delimiter_ptr;
+        bytes_in_buffer -= line_length;
+    }
+    // under memory pressure data is not kept till the flush timer, output queue should be empty
+    // though, otherwise flushing every datagram overruns it
+    if (global.memory.pressure >= MEMORY_PRESSURE_FLUSH && global.downstream.slot_table.length > 0 &&
+            global.downstream.flush_buffer_idx == global.downstream.active_buffer_idx) {
+        downstream_schedule_flush(&(global.downstream.slot_table));
+    }
+}
+
+/* function to process datagram of the listener with prefix. Prefix is prepended to every line, if
+ * result doesn't fit into buffer, lines collected so far are processed first.
+ */
+void process_prefixed_packet(struct listener_s *listener, char *buffer, ssize_t bytes_in_buffer) {
+    char *target_ptr = global.ingest.prefix_buffer;
+    char *buffer_ptr = buffer;
+    char *delimiter_ptr = NULL;
+    int line_length = 0;
+    int length = 0;
+
+    if ((unsigned char)buffer[0] == BINARY_MAGIC) {
+        process_binary_packet(listener->prefix, listener->prefix_length, buffer + 1, bytes_in_buffer - 1);
+        return;
+    }
+    if (buffer[bytes_in_buffer - 1] != '\n') {
+        buffer[bytes_in_buffer++] = '\n';
+    }
+    while ((delimiter_ptr = memchr(buffer_ptr, '\n', bytes_in_buffer)) != NULL) {
+        delimiter_ptr++;
+        line_length = delimiter_ptr - buffer_ptr;
+        // one byte is left for process_data_packet()
+        if (length + listener->prefix_length + line_length > sizeof(global.ingest.prefix_buffer) - 1) {
+            process_data_packet(target_ptr, length);
+            length = 0;
+        }
+        // names of aliases are used as registered
+        if (*buffer_ptr != '#' || global.aliases.names == NULL) {
+            memcpy(target_ptr + length, listener->prefix, listener->prefix_length);
+            length += listener->prefix_length;
+        }
+        memcpy(target_ptr + length, buffer_ptr, line_length);
+        length += line_length;
+        buffer_ptr = delimiter_ptr;
+        bytes_in_buffer -= line_length;
+    }
+    if (length > 0) {
+        process_data_packet(target_ptr, length);
+    }
+}
+
+// function to get kernel receive time of the datagram, 0 if there is none
+ev_tstamp packet_timestamp(struct msghdr *msg) {
+    struct cmsghdr *cmsg = NULL;
+    struct timespec *ts = NULL;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            ts = (struct timespec *)CMSG_DATA(cmsg);
+            return ts->tv_sec + ts->tv_nsec / 1e9;
+        }
+    }
+    return 0;
+}
+
+// function to flush data of the current interval, boundary is the start of the next one
+void close_interval(ev_tstamp boundary) {
+    if (global.downstream.slot_table.length > 0) {
+        downstream_schedule_flush(&(global.downstream.slot_table));
+    }
+    global.ingest.interval_start = boundary;
+}
+
+/* function to attribute datagram to the flush interval by its kernel receive time. Datagram from
+ * the next interval closes current one right away, datagram from already flushed interval is
+ * aggregated into the current one and counted as late.
+ */
+void attribute_packet(ev_tstamp stamp) {
+    ev_tstamp interval = global.downstream_flush_interval;
+
+    if (stamp == 0) {
+        return;
+    }
+    if (stamp >= global.ingest.interval_start + interval) {
+        global.ingest.early_flushes += (global.ingest.interval_start > 0);
+        close_interval((long long)(stamp / interval) * interval);
+    } else if (stamp < global.ingest.interval_start) {
+        global.ingest.late_packets++;
+    }
+}
+
+// function to close load window if it is over, load of the closed window includes time loop slept in epoll
+void update_load(ev_tstamp now) {
+    if (now - global.ingest.load_window_start < LOAD_WINDOW) {
+        return;
+    }
+    global.ingest.load = global.ingest.busy_time / (now - global.ingest.load_window_start);
+    global.ingest.busy_time = 0;
+    global.ingest.load_window_start = now;
+}
+
+/* function to read and process batch of datagrams without blocking, returns number of datagrams read.
+ * Every datagram can fill up to 3 output buffers, batch is limited by free output buffers, so that
+ * datagrams wait in the socket instead of being dropped when flushes don't keep up.
+ */
+int udp_receive(struct listener_s *listener, int max_batch_size) {
+    ev_tstamp start = 0;
+    ev_tstamp now = 0;
+    int pending = (global.downstream.active_buffer_idx - global.downstream.flush_buffer_idx + DOWNSTREAM_BUF_NUM) % DOWNSTREAM_BUF_NUM;
+    int batch_size = (DOWNSTREAM_BUF_NUM - 1 - pending) / (DATA_BUF_SIZE / DOWNSTREAM_BUF_SIZE + 1);
+    int received = 0;
+    int i = 0;
+
+    if (batch_size < 1) {
+        batch_size = 1;
+    } else if (batch_size > max_batch_size) {
+        batch_size = max_batch_size;
+    }
+    if (global.ingest.timestamps) {
+        // kernel sets length of control data it wrote, so it is reset before every call
+        for (i = 0; i < batch_size; i++) {
+            global.ingest.messages[i].msg_hdr.msg_controllen = TIMESTAMP_CONTROL_SIZE;
+        }
+    }
+    received = recvmmsg(listener->super.fd, global.ingest.messages, batch_size, MSG_DONTWAIT, NULL);
+    global.ingest.backlog = (received == batch_size);
+    if (received < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_msg(ERROR, "%s: recvmmsg() failed %s", __func__, strerror(errno));
+        }
+        return 0;
+    }
+    start = ev_time();
+    for (i = 0; i < received; i++) {
+        if (global.ingest.messages[i].msg_len == 0) {
+            continue;
+        }
+        if (global.ingest.timestamps) {
+            attribute_packet(packet_timestamp(&(global.ingest.messages[i].msg_hdr)));
+        }
+        if (listener->prefix_length > 0) {
+            process_prefixed_packet(listener, global.ingest.iovecs[i].iov_base, global.ingest.messages[i].msg_len);
+        } else {
+            process_data_packet(global.ingest.iovecs[i].iov_base, global.ingest.messages[i].msg_len);
+        }
+    }
+    now = ev_time();
+    global.ingest.busy_time += now - start;
+    update_load(now);
+    return received;
+}
+
+
+void udp_read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    int i = 0;
+
+    if (EV_ERROR & revents) {
+        log_msg(ERROR, "%s: invalid event %s", __func__, strerror(errno));
+        return;
+    }
+    udp_receive((struct listener_s *)watcher, RECV_BATCH_SIZE);
+    if (global.ingest.busy_poll == 0) {
+        return;
+    }
+    /* traffic is back, let's spin again if it is heavy: loop was busy enough or full batch was read,
+     * so more datagrams are waiting. Spinning stops only after busy_poll_idle_spins empty polls, so
+     * short gaps in heavy traffic don't switch us back and forth.
+     */
+    if (global.ingest.backlog || global.ingest.load >= global.ingest.busy_poll_load) {
+        log_msg(DEBUG, "%s: switching to busy polling", __func__);
+        global.ingest.busy_poll_switches++;
+        global.ingest.spins = 0;
+        for (i = 0; i < global.listeners_num; i++) {
+            ev_io_stop(loop, &(global.listeners[i].super));
+        }
+        ev_idle_start(loop, &(global.ingest.busy_poll_watcher));
+    }
+}
+
+// this function spins on the data sockets while there is traffic and falls back to epoll when they are idle
+void busy_poll_cb(struct ev_loop *loop, struct ev_idle *watcher, int revents) {
+    int received = 0;
+    int i = 0;
+
+    for (i = 0; i < global.listeners_num; i++) {
+        received += udp_receive(global.listeners + i, RECV_BATCH_SIZE);
+    }
+    if (received > 0) {
+        global.ingest.spins = 0;
+        return;
+    }
+    if (++global.ingest.spins >= global.ingest.busy_poll_idle_spins) {
+        log_msg(DEBUG, "%s: no data for %d polls, switching to epoll", __func__, global.ingest.spins);
+        global.ingest.busy_poll_switches++;
+        ev_idle_stop(loop, watcher);
+        for (i = 0; i < global.listeners_num; i++) {
+            ev_io_start(loop, &(global.listeners[i].super));
+        }
+    }
+}
+
+// function to process all datagrams waiting in the sockets without blocking
+void udp_drain() {
+    int i = 0;
+
+    for (i = 0; i < global.listeners_num; i++) {
+        while (udp_receive(global.listeners + i, RECV_BATCH_SIZE) > 0) {
+        }
+    }
+}
+
+/* function to process datagrams waiting in the sockets that arrived before the boundary. Receive
+ * time of the datagram is peeked first, datagrams after the boundary stay in the socket.
+ */
+void udp_drain_before(ev_tstamp boundary) {
+    char control[TIMESTAMP_CONTROL_SIZE];
+    struct msghdr msg;
+    struct iovec iov;
+    char byte = 0;
+    ev_tstamp stamp = 0;
+    int i = 0;
+
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    for (i = 0; i < global.listeners_num; i++) {
+        while (1) {
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (recvmsg(global.listeners[i].super.fd, &msg, MSG_PEEK | MSG_DONTWAIT) < 0) {
+                break;
+            }
+            stamp = packet_timestamp(&msg);
+            if (stamp == 0 || stamp >= boundary || udp_receive(global.listeners + i, 1) == 0) {
+                break;
             }
-            // this is not last metric, let's advance line start pointer
-            buffer_ptr = delimiter_ptr;
-            bytes_in_buffer -= line_length;
         }
     }
 }
 
+// function to parse cpu list like "0,2,4-7", returns 1 if list is invalid
+int parse_cpu_list(char *list, cpu_set_t *set) {
+    char *ptr = list;
+    char *endptr = NULL;
+    long first = 0;
+    long last = 0;
+
+    CPU_ZERO(set);
+    while (*ptr != 0) {
+        first = strtol(ptr, &endptr, 10);
+        if (endptr == ptr || first < 0 || first >= CPU_SETSIZE) {
+            return 1;
+        }
+        last = first;
+        if (*endptr == '-') {
+            ptr = endptr + 1;
+            last = strtol(ptr, &endptr, 10);
+            if (endptr == ptr || last < first || last >= CPU_SETSIZE) {
+                return 1;
+            }
+        }
+        for (; first <= last; first++) {
+            CPU_SET(first, set);
+        }
+        if (*endptr == ',') {
+            endptr++;
+        } else if (*endptr != 0) {
+            return 1;
+        }
+        ptr = endptr;
+    }
+    return CPU_COUNT(set) == 0;
+}
+
+// function to get numa node of the cpu, returns -1 if it is unknown
+int cpu_node(int cpu) {
+    char path[64];
+    struct dirent *entry = NULL;
+    int node = -1;
+    DIR *dir = NULL;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) == 0 && sscanf(entry->d_name + 4, "%d", &node) == 1) {
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+// function to pin loop thread to configured cpus, it is called before memory is touched so that
+// first touch places pages on the local numa node
+int init_cpu_affinity() {
+    global.cpu.current = -1;
+    global.cpu.node = -1;
+    global.cpu.candidate = -1;
+    if (! global.cpu.pinned) {
+        return 0;
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &(global.cpu.affinity)) != 0) {
+        log_msg(ERROR, "%s: pthread_setaffinity_np() failed", __func__);
+        return 1;
+    }
+    log_msg(INFO, "%s: loop thread is pinned to %d cpus", __func__, CPU_COUNT(&(global.cpu.affinity)));
+    return 0;
+}
+
+/* function to move loop thread to the cpu that handles packets of the data socket (the one
+ * the nic rx queue interrupts are steered to) and move memory region to its numa node. Only cpus
+ * of cpu_affinity are followed, and only once packets keep coming on the same cpu, so that the
+ * thread and its memory don't bounce between cpus.
+ */
+void follow_incoming_cpu() {
+    unsigned long nodemask = 0;
+    socklen_t length = sizeof(int);
+    cpu_set_t set;
+    int cpu = -1;
+    int node = -1;
+
+    if (getsockopt(global.listeners[0].super.fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) != 0 || cpu < 0 || cpu >= CPU_SETSIZE) {
+        return;
+    }
+    if (global.cpu.pinned && ! CPU_ISSET(cpu, &(global.cpu.affinity))) {
+        log_msg(DEBUG, "%s: cpu %d is not in cpu_affinity", __func__, cpu);
+        global.cpu.candidate = -1;
+        return;
+    }
+    if (cpu != global.cpu.candidate) {
+        global.cpu.candidate = cpu;
+        global.cpu.candidate_intervals = 0;
+    }
+    if (global.cpu.candidate_intervals < FOLLOW_INCOMING_CPU_INTERVALS) {
+        global.cpu.candidate_intervals++;
+    }
+    if (global.cpu.candidate_intervals < FOLLOW_INCOMING_CPU_INTERVALS || cpu == global.cpu.current) {
+        return;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) != 0) {
+        log_msg(ERROR, "%s: pthread_setaffinity_np() failed", __func__);
+        return;
+    }
+    global.cpu.current = cpu;
+    node = cpu_node(cpu);
+    log_msg(INFO, "%s: loop thread moved to cpu %d, node %d", __func__, cpu, node);
+    if (node < 0 || node == global.cpu.node || node >= sizeof(nodemask) * 8) {
+        return;
+    }
+    nodemask = 1UL << node;
+    if (syscall(__NR_mbind, global.memory.region, global.memory.size, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8, MPOL_MF_MOVE) != 0) {
+        log_msg(WARN, "%s: mbind() failed %s", __func__, strerror(errno));
+        return;
+    }
+    global.cpu.node = node;
+}
+
 // this function cycles through downstreams and flushes them on scheduled basis
 void downstream_flush_timer_cb(struct ev_loop *loop, struct ev_periodic *p, int revents) {
-    if (global.downstream.active_buffer_length > 0) {
-        downstream_schedule_flush();
+    ev_tstamp boundary = 0;
+
+    if (global.ingest.timestamps) {
+        // periodic is already rescheduled, so interval that ends now started one interval before that
+        boundary = ev_periodic_at(p) - global.downstream_flush_interval;
+        // if datagram from the new interval came first, interval is already closed
+        if (boundary > global.ingest.interval_start) {
+            udp_drain_before(boundary);
+            close_interval(boundary);
+        }
+    } else if (global.downstream.slot_table.length > 0) {
+        downstream_schedule_flush(&(global.downstream.slot_table));
+    }
+    if (global.lateness.window > 0) {
+        flush_lateness_window();
+    }
+    if (global.cpu.follow_incoming_cpu) {
+        follow_incoming_cpu();
     }
 }
 
-void get_dns_data() {
+/* function to resolve downstream host and publish its addresses for the event loop, returns 0 on success.
+ * It runs in the downstream_refresh() thread, so memory is not taken from the budget: mem_alloc()
+ * accounting belongs to the event loop. Snapshot that event loop didn't take yet is replaced.
+ */
+int get_dns_data() {
     int i = 0;
-    struct in_addr *addr = NULL;
+    struct downstream_addrs_s *addrs = NULL;
     struct hostent *he = gethostbyname(global.downstream.data_host);
 
     if (he == NULL || he->h_addr_list == NULL || (he->h_addr_list)[0] == NULL ) {
         log_msg(ERROR, "%s: gethostbyname() failed %s", __func__, strerror(errno));
-        return;
+        return 1;
+    }
+    addrs = malloc(sizeof(struct downstream_addrs_s));
+    if (addrs == NULL) {
+        log_msg(ERROR, "%s: malloc() failed", __func__);
+        return 1;
     }
     for (i = 0; i < MAX_DOWNSTREAM_NUM && he->h_addr_list[i] != NULL; i++) {
-        addr = global.downstream.in_addr_new + i;
-        memcpy(addr, he->h_addr_list[i], he->h_length);
+        memcpy(addrs->addrs + i, he->h_addr_list[i], he->h_length);
         log_msg(DEBUG, "%s: %s", __func__, inet_ntoa(*(struct in_addr *)(he->h_addr_list[i])));
     }
-    global.downstream.downstream_host_num = i;
-    global.downstream.in_addr_new_ready = 1;
+    addrs->num = i;
+    // release makes the filled snapshot visible together with the pointer
+    free(__atomic_exchange_n(&(global.downstream.addrs_new), addrs, __ATOMIC_ACQ_REL));
+    return 0;
 }
 
 // function to init downstream from config file line
@@ -497,14 +2462,14 @@ int init_downstream(char *hosts) {
     // argument line has the following format: host:data_port
     // now let's initialize downstreams
     global.downstream.packets_sent = 0;
-    global.downstream.slots_used = 0;
+    global.downstream.slot_table.slots_used = 0;
     global.downstream.downstream_host_num = 0;
     global.downstream.downstream_hosts = NULL;
     global.downstream.current_downstream_host = NULL;
     global.downstream.active_buffer_idx = 0;
-    global.downstream.active_buffer = global.downstream.buffer;
-    global.downstream.active_buffer_length = 0;
+    global.downstream.slot_table.length = 0;
     global.downstream.flush_buffer_idx = 0;
+    ev_init(&(global.downstream.retry_watcher), downstream_retry_cb);
     global.downstream.flush_watcher.fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);;
     if (global.downstream.flush_watcher.fd < 0) {
         log_msg(ERROR, "%s: socket() failed %s", __func__, strerror(errno));
@@ -527,44 +2492,551 @@ int init_downstream(char *hosts) {
         log_msg(ERROR, "%s: no health port for %s", __func__, host);
         return 1;
     }
-    *health_port_s++ = 0;
-    global.downstream.data_port = atoi(data_port_s);
-    global.downstream.health_port = atoi(health_port_s);
-    global.downstream.in_addr_new_ready = 0;
-    get_dns_data();
-    if (global.downstream.in_addr_new_ready != 1) {
-        log_msg(ERROR, "%s: failed to retrieve downstream hosts", __func__);
+    *health_port_s++ = 0;
+    global.downstream.data_port = atoi(data_port_s);
+    global.downstream.health_port = atoi(health_port_s);
+    global.downstream.addrs_new = NULL;
+    if (get_dns_data() != 0) {
+        log_msg(ERROR, "%s: failed to retrieve downstream hosts", __func__);
+        return 1;
+    }
+    return 0;
+}
+
+// function to add listener, returns NULL if there are too many of them or address is invalid
+struct listener_s *add_listener(char *address, int port, char *prefix) {
+    struct listener_s *listener = global.listeners + global.listeners_num;
+
+    if (global.listeners_num == MAX_LISTENERS) {
+        log_msg(ERROR, "%s: too many listeners, max is %d", __func__, MAX_LISTENERS);
+        return NULL;
+    }
+    bzero(listener, sizeof(struct listener_s));
+    listener->addr.sin_family = AF_INET;
+    listener->addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address, &(listener->addr.sin_addr)) != 1) {
+        log_msg(ERROR, "%s: invalid address \"%s\"", __func__, address);
+        return NULL;
+    }
+    if (prefix != NULL) {
+        listener->prefix_length = strlen(prefix);
+        if (listener->prefix_length >= MAX_PREFIX_LENGTH) {
+            log_msg(ERROR, "%s: prefix \"%s\" is too long, max length is %d", __func__, prefix, MAX_PREFIX_LENGTH - 1);
+            return NULL;
+        }
+        listener->prefix = strdup(prefix);
+    }
+    global.listeners_num++;
+    return listener;
+}
+
+// function to parse listener line like "127.0.0.1:8125,prefix=legacy.,rcvbuf=8388608"
+int init_listener_config(char *value) {
+    struct listener_s *listener = NULL;
+    char *options = strchr(value, ',');
+    char *port_s = NULL;
+    char *option = NULL;
+    char *prefix = NULL;
+    int rcvbuf = 0;
+
+    if (options != NULL) {
+        *options++ = 0;
+    }
+    port_s = strchr(value, ':');
+    if (port_s == NULL) {
+        log_msg(ERROR, "%s: listener should look like address:port[,option=value...]", __func__);
+        return 1;
+    }
+    *port_s++ = 0;
+    while ((option = strsep(&options, ",")) != NULL) {
+        if (strncmp(option, "prefix=", STRLEN("prefix=")) == 0) {
+            prefix = option + STRLEN("prefix=");
+        } else if (strncmp(option, "rcvbuf=", STRLEN("rcvbuf=")) == 0) {
+            rcvbuf = atoi(option + STRLEN("rcvbuf="));
+        } else {
+            log_msg(ERROR, "%s: unknown listener option \"%s\"", __func__, option);
+            return 1;
+        }
+    }
+    listener = add_listener(value, atoi(port_s), prefix);
+    if (listener == NULL) {
+        return 1;
+    }
+    listener->rcvbuf = rcvbuf;
+    return 0;
+}
+
+// function to get rule for the prefix from config, new rule is added if there is none yet
+struct rule_s *get_rule(char *prefix) {
+    struct rule_s *rule = NULL;
+    int i = 0;
+
+    for (i = 0; i < global.rules_num; i++) {
+        if (strcmp(global.rules[i].prefix, prefix) == 0) {
+            return global.rules + i;
+        }
+    }
+    if (global.rules_num == MAX_RULES) {
+        log_msg(ERROR, "%s: too many prefixes with settings, max is %d", __func__, MAX_RULES);
+        return NULL;
+    }
+    rule = global.rules + global.rules_num++;
+    bzero(rule, sizeof(struct rule_s));
+    rule->prefix = strdup(prefix);
+    rule->prefix_length = strlen(prefix);
+    return rule;
+}
+
+// function to parse histogram line like "api.latency.:10,50,100,500", bounds should be ascending
+int init_histogram_config(char *value) {
+    struct rule_s *rule = NULL;
+    char *bounds = strchr(value, ':');
+    char *bound = NULL;
+    char *endptr = NULL;
+    double previous = -INFINITY;
+    int i = 0;
+
+    if (bounds == NULL) {
+        log_msg(ERROR, "%s: histogram should look like prefix:bound,bound,...", __func__);
+        return 1;
+    }
+    *bounds++ = 0;
+    rule = get_rule(value);
+    if (rule == NULL) {
+        return 1;
+    }
+    rule->bins_num = 0;
+    rule->labels_length = 0;
+    while ((bound = strsep(&bounds, ",")) != NULL) {
+        if (rule->bins_num == MAX_HISTOGRAM_BINS - 1) {
+            log_msg(ERROR, "%s: too many histogram bounds, max is %d", __func__, MAX_HISTOGRAM_BINS - 1);
+            return 1;
+        }
+        errno = 0;
+        rule->bounds[rule->bins_num] = strtod(bound, &endptr);
+        if (errno != 0 || endptr == bound || *endptr != 0 || ! isfinite(rule->bounds[rule->bins_num]) ||
+                rule->bounds[rule->bins_num] <= previous || strlen(bound) >= MAX_BIN_LABEL_LENGTH) {
+            log_msg(ERROR, "%s: invalid histogram bound \"%s\"", __func__, bound);
+            return 1;
+        }
+        previous = rule->bounds[rule->bins_num];
+        // dots would add a level to graphite hierarchy
+        for (i = 0; bound[i] != 0; i++) {
+            rule->labels[rule->bins_num][i] = (bound[i] == '.') ? '_' : bound[i];
+        }
+        rule->label_lengths[rule->bins_num++] = i;
+    }
+    // the rest of the bounds is padding for branch-free bin search, the last bin catches everything above
+    for (i = rule->bins_num; i < MAX_HISTOGRAM_BINS; i++) {
+        rule->bounds[i] = INFINITY;
+    }
+    memcpy(rule->labels[rule->bins_num], "inf", STRLEN("inf"));
+    rule->label_lengths[rule->bins_num++] = STRLEN("inf");
+    for (i = 0; i < rule->bins_num; i++) {
+        rule->labels_length += rule->label_lengths[i];
+    }
+    return 0;
+}
+
+// function to parse max_samples line like "api.latency.:20"
+int init_max_samples_config(char *value) {
+    struct rule_s *rule = NULL;
+    char *samples = strchr(value, ':');
+
+    if (samples == NULL) {
+        log_msg(ERROR, "%s: max_samples should look like prefix:N", __func__);
+        return 1;
+    }
+    *samples++ = 0;
+    rule = get_rule(value);
+    if (rule == NULL) {
+        return 1;
+    }
+    rule->max_samples = atoi(samples);
+    if (rule->max_samples < 1 || rule->max_samples > MAX_SAMPLES) {
+        log_msg(ERROR, "%s: max_samples should be between 1 and %d", __func__, MAX_SAMPLES);
+        return 1;
+    }
+    return 0;
+}
+
+// function to parse quantize line like "api.latency.:digits=3" or "api.latency.:step=0.5"
+int init_quantize_config(char *value) {
+    struct rule_s *rule = NULL;
+    char *option = strchr(value, ':');
+    char *endptr = NULL;
+
+    if (option == NULL) {
+        log_msg(ERROR, "%s: quantize should look like prefix:digits=N or prefix:step=X", __func__);
+        return 1;
+    }
+    *option++ = 0;
+    rule = get_rule(value);
+    if (rule == NULL) {
+        return 1;
+    }
+    rule->quantize_digits = 0;
+    rule->quantize_step = 0;
+    if (strncmp(option, "digits=", STRLEN("digits=")) == 0) {
+        rule->quantize_digits = atoi(option + STRLEN("digits="));
+        if (rule->quantize_digits < 1 || rule->quantize_digits > 17) {
+            log_msg(ERROR, "%s: digits should be between 1 and 17", __func__);
+            return 1;
+        }
+    } else if (strncmp(option, "step=", STRLEN("step=")) == 0) {
+        rule->quantize_step = strtod(option + STRLEN("step="), &endptr);
+        if (*endptr != 0 || ! (rule->quantize_step > 0) || ! isfinite(rule->quantize_step)) {
+            log_msg(ERROR, "%s: step should be positive number", __func__);
+            return 1;
+        }
+    } else {
+        log_msg(ERROR, "%s: unknown quantize option \"%s\"", __func__, option);
+        return 1;
+    }
+    return 0;
+}
+
+// function to parse single line from config file
+int process_config_line(char *line) {
+    // valid line should contain '=' symbol
+    char *value_ptr = strchr(line, '=');
+    if (value_ptr == NULL) {
+        log_msg(ERROR, "%s: bad line in config \"%s\"", __func__, line);
+        return 1;
+    }
+    *value_ptr++ = 0;
+    if (strcmp("data_port", line) == 0) {
+        global.data_port = atoi(value_ptr);
+    } else if (strcmp("listen", line) == 0) {
+        return init_listener_config(value_ptr);
+    } else if (strcmp("downstream_flush_interval", line) == 0) {
+        global.downstream_flush_interval = atof(value_ptr);
+    } else if (strcmp("log_level", line) == 0) {
+        global.log_level = atoi(value_ptr);
+    } else if (strcmp("dns_refresh_interval", line) == 0) {
+        global.dns_refresh_interval = atoi(value_ptr);
+    } else if (strcmp("downstream_health_check_interval", line) == 0) {
+        global.downstream_health_check_interval = atof(value_ptr);
+    } else if (strcmp("downstream_sndbuf", line) == 0) {
+        global.downstream.sndbuf = atoi(value_ptr);
+    } else if (strcmp("downstream_send_retries", line) == 0) {
+        global.downstream.send_retries = atoi(value_ptr);
+    } else if (strcmp("downstream_send_max_age", line) == 0) {
+        global.downstream.send_max_age = atof(value_ptr);
+    } else if (strcmp("clock", line) == 0) {
+        if (strcmp("real", value_ptr) == 0) {
+            global.clock = CLOCK_REAL;
+        } else if (strcmp("virtual", value_ptr) == 0) {
+            global.clock = CLOCK_VIRTUAL;
+        } else {
+            log_msg(ERROR, "%s: unknown clock \"%s\"", __func__, value_ptr);
+            return 1;
+        }
+    } else if (strcmp("name_hash", line) == 0) {
+        return init_name_hasher(value_ptr);
+    } else if (strcmp("sanitize_names", line) == 0) {
+        global.sanitize_names = atoi(value_ptr);
+    } else if (strcmp("huge_pages", line) == 0) {
+        if (strcmp("none", value_ptr) == 0) {
+            global.memory.huge_pages = HUGE_PAGES_NONE;
+        } else if (strcmp("transparent", value_ptr) == 0) {
+            global.memory.huge_pages = HUGE_PAGES_TRANSPARENT;
+        } else if (strcmp("explicit", value_ptr) == 0) {
+            global.memory.huge_pages = HUGE_PAGES_EXPLICIT;
+        } else {
+            log_msg(ERROR, "%s: unknown huge_pages \"%s\"", __func__, value_ptr);
+            return 1;
+        }
+    } else if (strcmp("receive_timestamps", line) == 0) {
+        global.ingest.timestamps = atoi(value_ptr);
+    } else if (strcmp("histogram", line) == 0) {
+        return init_histogram_config(value_ptr);
+    } else if (strcmp("quantize", line) == 0) {
+        return init_quantize_config(value_ptr);
+    } else if (strcmp("max_samples", line) == 0) {
+        return init_max_samples_config(value_ptr);
+    } else if (strcmp("lateness_window", line) == 0) {
+        global.lateness.window = atoi(value_ptr);
+        if (global.lateness.window < 0 || global.lateness.window > MAX_LATENESS_WINDOW) {
+            log_msg(ERROR, "%s: lateness_window should be between 0 and %d", __func__, MAX_LATENESS_WINDOW);
+            return 1;
+        }
+    } else if (strcmp("busy_poll", line) == 0) {
+        global.ingest.busy_poll = atoi(value_ptr);
+    } else if (strcmp("busy_poll_idle_spins", line) == 0) {
+        global.ingest.busy_poll_idle_spins = atoi(value_ptr);
+    } else if (strcmp("busy_poll_load", line) == 0) {
+        global.ingest.busy_poll_load = atof(value_ptr);
+        if (global.ingest.busy_poll_load < 0 || global.ingest.busy_poll_load > 1) {
+            log_msg(ERROR, "%s: busy_poll_load should be between 0 and 1", __func__);
+            return 1;
+        }
+    } else if (strcmp("cpu_affinity", line) == 0) {
+        if (parse_cpu_list(value_ptr, &(global.cpu.affinity)) != 0) {
+            log_msg(ERROR, "%s: invalid cpu list \"%s\"", __func__, value_ptr);
+            return 1;
+        }
+        global.cpu.pinned = 1;
+    } else if (strcmp("follow_incoming_cpu", line) == 0) {
+        global.cpu.follow_incoming_cpu = atoi(value_ptr);
+    } else if (strcmp("max_memory", line) == 0) {
+        global.memory.max = strtoull(value_ptr, NULL, 10);
+    } else if (strcmp("stats_interval", line) == 0) {
+        global.stats.interval = atof(value_ptr);
+    } else if (strcmp("tap_socket", line) == 0) {
+        global.tap.socket_path = strdup(value_ptr);
+    } else if (strcmp("alias_socket", line) == 0) {
+        global.aliases.socket_path = strdup(value_ptr);
+    } else if (strcmp("downstream", line) == 0) {
+        return init_downstream(value_ptr);
+    } else {
+        log_msg(ERROR, "%s: unknown parameter \"%s\"", __func__, line);
+        return 1;
+    }
+    return 0;
+}
+
+// function to recalculate memory pressure level after accounted memory changed
+void update_memory_pressure() {
+    int pressure = MEMORY_PRESSURE_NONE;
+    size_t headroom = 0;
+    size_t used = 0;
+
+    if (global.memory.baseline > 0 && global.memory.max > global.memory.baseline) {
+        headroom = global.memory.max - global.memory.baseline;
+        // memory of startup can be freed later, e.g. with downstream hosts
+        used = global.memory.allocated > global.memory.baseline ? global.memory.allocated - global.memory.baseline : 0;
+        if (used >= headroom * MEMORY_SHED_THRESHOLD) {
+            pressure = MEMORY_PRESSURE_SHED;
+        } else if (used >= headroom * MEMORY_REFUSE_THRESHOLD) {
+            pressure = MEMORY_PRESSURE_REFUSE;
+        } else if (used >= headroom * MEMORY_FLUSH_THRESHOLD) {
+            pressure = MEMORY_PRESSURE_FLUSH;
+        }
+    }
+    if (pressure != global.memory.pressure) {
+        log_msg(WARN, "%s: memory pressure level changed from %d to %d, %zu of %zu bytes used", __func__,
+            global.memory.pressure, pressure, global.memory.allocated, global.memory.max);
+        global.memory.pressure = pressure;
+    }
+}
+
+// function to account memory against max_memory, returns 1 if budget would be exceeded
+int memory_reserve(size_t size) {
+    if (global.memory.max > 0 && global.memory.allocated + size > global.memory.max) {
+        global.stats.allocations_failed++;
+        log_msg(ERROR, "%s: can't allocate %zu bytes, %zu of %zu bytes used", __func__, size, global.memory.allocated, global.memory.max);
+        return 1;
+    }
+    global.memory.allocated += size;
+    update_memory_pressure();
+    return 0;
+}
+
+void memory_release(size_t size) {
+    global.memory.allocated -= size;
+    update_memory_pressure();
+}
+
+// malloc() accounted against max_memory, returns NULL if budget is exceeded
+void *mem_alloc(size_t size) {
+    void *ptr = NULL;
+
+    if (memory_reserve(size) != 0) {
+        return NULL;
+    }
+    ptr = malloc(size);
+    if (ptr == NULL) {
+        log_msg(ERROR, "%s: malloc() failed", __func__);
+        memory_release(size);
+    }
+    return ptr;
+}
+
+// free() for memory from mem_alloc(), caller passes the same size
+void mem_free(void *ptr, size_t size) {
+    free(ptr);
+    memory_release(size);
+}
+
+// function to take cache line aligned chunk of the memory region
+void *memory_region_alloc(size_t size) {
+    char *ptr = global.memory.region + global.memory.used;
+
+    global.memory.used += (size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    return ptr;
+}
+
+/* function to map memory region backed by transparent huge pages. Region is rounded to huge page size
+ * and aligned to it, otherwise kernel can't use huge pages for it.
+ */
+char *map_transparent_huge_pages(size_t size) {
+    char *region = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    char *aligned = NULL;
+
+    if (region == MAP_FAILED) {
+        log_msg(ERROR, "%s: mmap() failed %s", __func__, strerror(errno));
+        return NULL;
+    }
+    aligned = (char *)(((uintptr_t)region + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned > region) {
+        munmap(region, aligned - region);
+    }
+    munmap(aligned + size, region + HUGE_PAGE_SIZE - aligned);
+    if (madvise(aligned, size, MADV_HUGEPAGE) != 0) {
+        log_msg(WARN, "%s: madvise() failed %s, using regular pages", __func__, strerror(errno));
+    }
+    return aligned;
+}
+
+/* function to allocate slots, slot index and output buffers from single memory region.
+ * With huge pages they are covered by one TLB entry. Explicit huge pages fall back to
+ * transparent ones if none are reserved, region is faulted in right away.
+ */
+int init_memory() {
+    size_t size = sizeof(slot_s) * NUM_OF_SLOTS + sizeof(int) * SLOT_INDEX_SIZE + DOWNSTREAM_BUF_SIZE * DOWNSTREAM_BUF_NUM +
+        RECV_BATCH_SIZE * DATA_BUF_SIZE + 4 * CACHE_LINE_SIZE;
+    char *region = MAP_FAILED;
+
+    if (global.memory.huge_pages != HUGE_PAGES_NONE) {
+        size = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+    }
+    if (memory_reserve(size) != 0) {
+        log_msg(ERROR, "%s: max_memory is too small for slots and buffers", __func__);
+        return 1;
+    }
+    if (global.memory.huge_pages == HUGE_PAGES_EXPLICIT) {
+        region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (region == MAP_FAILED) {
+            log_msg(WARN, "%s: mmap() with MAP_HUGETLB failed %s, using transparent huge pages", __func__, strerror(errno));
+            global.memory.huge_pages = HUGE_PAGES_TRANSPARENT;
+        }
+    }
+    if (global.memory.huge_pages == HUGE_PAGES_TRANSPARENT) {
+        region = map_transparent_huge_pages(size);
+        if (region == NULL) {
+            return 1;
+        }
+    }
+    if (global.memory.huge_pages == HUGE_PAGES_NONE) {
+        region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED) {
+            log_msg(ERROR, "%s: mmap() failed %s", __func__, strerror(errno));
+            return 1;
+        }
+    }
+    memset(region, 0, size);
+    global.memory.region = region;
+    global.memory.size = size;
+    global.memory.used = 0;
+    global.downstream.slot_table.slots = memory_region_alloc(sizeof(slot_s) * NUM_OF_SLOTS);
+    global.downstream.slot_table.slot_index = memory_region_alloc(sizeof(int) * SLOT_INDEX_SIZE);
+    global.downstream.buffer = memory_region_alloc(DOWNSTREAM_BUF_SIZE * DOWNSTREAM_BUF_NUM);
+    global.downstream.active_buffer = global.downstream.buffer + global.downstream.active_buffer_idx * DOWNSTREAM_BUF_SIZE;
+    global.ingest.buffers = memory_region_alloc(RECV_BATCH_SIZE * DATA_BUF_SIZE);
+    log_msg(DEBUG, "%s: allocated %zu bytes, huge pages mode %d", __func__, size, global.memory.huge_pages);
+    return 0;
+}
+
+/* function to allocate ring of slot tables for the lateness window. Every table takes as much as
+ * slots of the current interval, so memory is bounded by the window size.
+ */
+int init_lateness_window() {
+    struct slot_table_s *table = NULL;
+    int i = 0;
+
+    if (global.lateness.window == 0) {
+        return 0;
+    }
+    global.lateness.tables = mem_alloc(sizeof(struct slot_table_s) * global.lateness.window);
+    if (global.lateness.tables == NULL) {
         return 1;
     }
+    memset(global.lateness.tables, 0, sizeof(struct slot_table_s) * global.lateness.window);
+    for (i = 0; i < global.lateness.window; i++) {
+        table = global.lateness.tables + i;
+        table->interval = -1;
+        table->slots = mem_alloc(sizeof(slot_s) * NUM_OF_SLOTS);
+        table->slot_index = mem_alloc(sizeof(int) * SLOT_INDEX_SIZE);
+        if (table->slots == NULL || table->slot_index == NULL) {
+            log_msg(ERROR, "%s: max_memory is too small for lateness window of %d intervals", __func__, global.lateness.window);
+            return 1;
+        }
+        memset(table->slot_index, 0, sizeof(int) * SLOT_INDEX_SIZE);
+    }
     return 0;
 }
 
-// function to parse single line from config file
-int process_config_line(char *line) {
-    // valid line should contain '=' symbol
-    char *value_ptr = strchr(line, '=');
-    if (value_ptr == NULL) {
-        log_msg(ERROR, "%s: bad line in config \"%s\"", __func__, line);
-        return 1;
+// function to open perf counter of dTLB load misses for the calling thread
+int init_stats() {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    global.stats.dtlb_misses = 0;
+    global.stats.dtlb_misses_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (global.stats.dtlb_misses_fd < 0) {
+        log_msg(WARN, "%s: perf_event_open() failed %s, dTLB misses are not counted", __func__, strerror(errno));
     }
-    *value_ptr++ = 0;
-    if (strcmp("data_port", line) == 0) {
-        global.data_port = atoi(value_ptr);
-    } else if (strcmp("downstream_flush_interval", line) == 0) {
-        global.downstream_flush_interval = atof(value_ptr);
-    } else if (strcmp("log_level", line) == 0) {
-        global.log_level = atoi(value_ptr);
-    } else if (strcmp("dns_refresh_interval", line) == 0) {
-        global.dns_refresh_interval = atoi(value_ptr);
-    } else if (strcmp("downstream_health_check_interval", line) == 0) {
-        global.downstream_health_check_interval = atof(value_ptr);
-    } else if (strcmp("downstream", line) == 0) {
-        return init_downstream(value_ptr);
+    return 0;
+}
+
+// function to get value of the field from /proc/self/smaps_rollup in kB, 0 if not found
+long read_smaps_rollup_kb(char *field) {
+    char line[256];
+    long value = 0;
+    int field_length = strlen(field);
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+
+    if (f == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, field, field_length) == 0 && line[field_length] == ':') {
+            value = atol(line + field_length + 1);
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+// function to log memory usage and dTLB misses since the previous call
+void log_stats() {
+    uint64_t dtlb_misses = 0;
+    long rss_pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (f != NULL) {
+        if (fscanf(f, "%*s %ld", &rss_pages) != 1) {
+            rss_pages = 0;
+        }
+        fclose(f);
+    }
+    update_load(ev_time());
+    log_msg(INFO, "%s: memory %zu of %zu bytes, pressure %d, refused names %llu, shed values %llu, failed allocations %llu, busy poll switches %llu, late packets %llu, early flushes %llu, timestamps out of window %llu, mixed interval lines %llu, unknown aliases %llu, send retries %llu, send drops %llu, loop load %.3f", __func__,
+        global.memory.allocated, global.memory.max, global.memory.pressure, (unsigned long long)global.stats.names_refused,
+        (unsigned long long)global.stats.values_shed, (unsigned long long)global.stats.allocations_failed,
+        (unsigned long long)global.ingest.busy_poll_switches, (unsigned long long)global.ingest.late_packets,
+        (unsigned long long)global.ingest.early_flushes, (unsigned long long)global.lateness.out_of_window,
+        (unsigned long long)global.lateness.mixed_intervals, (unsigned long long)global.aliases.unknown,
+        (unsigned long long)global.stats.send_retries, (unsigned long long)global.stats.send_drops, global.ingest.load);
+    if (global.stats.dtlb_misses_fd >= 0 && read(global.stats.dtlb_misses_fd, &dtlb_misses, sizeof(dtlb_misses)) == sizeof(dtlb_misses)) {
+        log_msg(INFO, "%s: rss %ld kB, huge pages %ld kB, dtlb load misses %llu", __func__, rss_pages * (sysconf(_SC_PAGESIZE) / 1024),
+            read_smaps_rollup_kb("AnonHugePages") + read_smaps_rollup_kb("Private_Hugetlb"), (unsigned long long)(dtlb_misses - global.stats.dtlb_misses));
+        global.stats.dtlb_misses = dtlb_misses;
     } else {
-        log_msg(ERROR, "%s: unknown parameter \"%s\"", __func__, line);
-        return 1;
+        log_msg(INFO, "%s: rss %ld kB, huge pages %ld kB", __func__, rss_pages * (sysconf(_SC_PAGESIZE) / 1024),
+            read_smaps_rollup_kb("AnonHugePages") + read_smaps_rollup_kb("Private_Hugetlb"));
     }
-    return 0;
+}
+
+void stats_timer_cb(struct ev_loop *loop, struct ev_periodic *p, int revents) {
+    log_stats();
 }
 
 // this function is called if SIGHUP is received
@@ -587,6 +3059,11 @@ int init_config(char *filename) {
     global.log_level = DEFAULT_LOG_LEVEL;
     global.dns_refresh_interval = DEFAULT_DNS_REFRESH_INTERVAL;
     global.downstream_health_check_interval = DEFAULT_DOWNSTREAM_HEALTHCHECK_INTERVAL;
+    global.clock = CLOCK_REAL;
+    global.ingest.busy_poll_idle_spins = DEFAULT_BUSY_POLL_IDLE_SPINS;
+    global.downstream.send_retries = DEFAULT_DOWNSTREAM_SEND_RETRIES;
+    global.downstream.send_max_age = DEFAULT_DOWNSTREAM_SEND_MAX_AGE;
+    init_sanitize_table();
     FILE *config_file = fopen(filename, "rt");
     if (config_file == NULL) {
         log_msg(ERROR, "%s: fopen() failed %s", __func__, strerror(errno));
@@ -605,10 +3082,17 @@ int init_config(char *filename) {
     // buffer is reused by getline() so we need to free it only once
     free(buffer);
     fclose(config_file);
+    if (global.name_hasher == NULL) {
+        failures += init_name_hasher("auto");
+    }
     if (failures > 0) {
         log_msg(ERROR, "%s: failed to load config file", __func__);
         return 1;
     }
+    // downstream socket is created by the downstream line, which can come before downstream_sndbuf
+    if (global.downstream.data_host != NULL) {
+        setup_downstream_socket(global.downstream.flush_watcher.fd);
+    }
     if (signal(SIGHUP, on_sighup) == SIG_ERR) {
         log_msg(ERROR, "%s: signal() failed", __func__);
         return 1;
@@ -623,33 +3107,34 @@ int init_config(char *filename) {
 void *downstream_refresh(void *args) {
     while(1) {
         sleep(global.dns_refresh_interval);
-        // if sockaddr data was copied let's refresh data
-        if (global.downstream.in_addr_new_ready == 0) {
-            get_dns_data();
-        }
+        get_dns_data();
     }
     return NULL;
 }
 
+/* function to apply addresses published by downstream_refresh(). Snapshot is taken over with atomic
+ * exchange, so resolver thread never touches it again and it is freed here without any locking.
+ */
 void update_downstreams(struct ev_loop *loop) {
     struct downstream_host_s *host = global.downstream.downstream_hosts;
     struct downstream_host_s *next = NULL;
     struct downstream_host_s **prev = &global.downstream.downstream_hosts;
+    struct downstream_addrs_s *addrs = __atomic_exchange_n(&(global.downstream.addrs_new), NULL, __ATOMIC_ACQUIRE);
+    struct downstream_addrs_s *expected = NULL;
     int i = 0;
     int delete_host = 0;
 
     // if there is no new data just return
-    if (global.downstream.in_addr_new_ready == 0) {
+    if (addrs == NULL) {
         return;
     }
-    // if there is new sockaddr data let's copy it and reset the flag
+    global.downstream.downstream_host_num = addrs->num;
     while (host != NULL) {
         next = host->next;
         delete_host = 1;
         log_msg(DEBUG, "%s: existing ip: %s", __func__, inet_ntoa(host->sa_in_data.sin_addr));
-        for (i = 0; i < global.downstream.downstream_host_num; i++) {
-            if (host->sa_in_data.sin_addr.s_addr == (global.downstream.in_addr_new + i)->s_addr) {
-                (global.downstream.in_addr_new + i)->s_addr = 0;
+        for (i = 0; i < addrs->num; i++) {
+            if (host->sa_in_data.sin_addr.s_addr == addrs->addrs[i].s_addr) {
                 delete_host = 0;
                 log_msg(DEBUG, "%s: this ip is valid", __func__);
                 break;
@@ -665,41 +3150,441 @@ void update_downstreams(struct ev_loop *loop) {
                 }
                 close(host->health_client.super.fd);
             }
-            free(host);
+            mem_free(host, sizeof(struct downstream_host_s));
+        } else {
+            prev = &(host->next);
         }
-        prev = &(host->next);
         host = next;
     }
-    for (i = 0; i < global.downstream.downstream_host_num; i++) {
-        if ((global.downstream.in_addr_new + i)->s_addr == 0) {
+    // snapshot is left intact, so that it can be put back if allocation fails
+    for (i = 0; i < addrs->num; i++) {
+        host = global.downstream.downstream_hosts;
+        while (host != NULL && host->sa_in_data.sin_addr.s_addr != addrs->addrs[i].s_addr) {
+            host = host->next;
+        }
+        if (host != NULL) {
             continue;
         }
-        host = (struct downstream_host_s *)malloc(sizeof(struct downstream_host_s));
+        host = (struct downstream_host_s *)mem_alloc(sizeof(struct downstream_host_s));
         if (host == NULL) {
             log_msg(ERROR, "%s: failed to allocate memory for the downstream_host_s", __func__);
+            // hosts from the snapshot that exist already are kept on the next call and the rest is
+            // retried, unless resolver published newer addresses already
+            if (!__atomic_compare_exchange_n(&(global.downstream.addrs_new), &expected, addrs,
+                    0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+                free(addrs);
+            }
             return;
         }
         bzero(&(host->sa_in_data), sizeof(host->sa_in_data));
         host->sa_in_data.sin_family = AF_INET;
         host->sa_in_data.sin_port = htons(global.downstream.data_port);
-        host->sa_in_data.sin_addr = global.downstream.in_addr_new[i];
+        host->sa_in_data.sin_addr = addrs->addrs[i];
         host->health_client.sa_in.sin_family = AF_INET;
         host->health_client.sa_in.sin_port = htons(global.downstream.health_port);
-        host->health_client.sa_in.sin_addr = global.downstream.in_addr_new[i];
+        host->health_client.sa_in.sin_addr = addrs->addrs[i];
         host->health_client.super.fd = -1;
         host->health_client.alive = 0;
         log_msg(DEBUG, "%s: added new ip: %s", __func__, inet_ntoa(host->sa_in_data.sin_addr));
         host->next = global.downstream.downstream_hosts;
         global.downstream.downstream_hosts = host;
     }
+    free(addrs);
+}
+
+// function to create and bind socket of the listener
+int init_listener(struct listener_s *listener) {
+    int fd = socket(PF_INET, SOCK_DGRAM, 0);
+
+    if (fd < 0) {
+        log_msg(ERROR, "%s: socket() error %s", __func__, strerror(errno));
+        return 1;
+    }
+    if (listener->rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &(listener->rcvbuf), sizeof(int)) != 0) {
+        log_msg(WARN, "%s: setsockopt(SO_RCVBUF) failed %s", __func__, strerror(errno));
+    }
+    if (bind(fd, (struct sockaddr*) &(listener->addr), sizeof(listener->addr)) != 0) {
+        log_msg(ERROR, "%s: bind() to %s:%d failed %s", __func__, inet_ntoa(listener->addr.sin_addr), ntohs(listener->addr.sin_port), strerror(errno));
+        close(fd);
+        return 1;
+    }
+    if (global.ingest.busy_poll > 0 && setnonblock(fd) != 0) {
+        log_msg(ERROR, "%s: setnonblock() failed %s", __func__, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    ev_io_init(&(listener->super), udp_read_cb, fd, EV_READ);
+    log_msg(INFO, "%s: listening on %s:%d, prefix \"%.*s\"", __func__, inet_ntoa(listener->addr.sin_addr), ntohs(listener->addr.sin_port),
+        listener->prefix_length, listener->prefix_length > 0 ? listener->prefix : "");
+    return 0;
+}
+
+/* function to start reading data sockets. In busy poll mode sockets are polled from ev_idle watcher,
+ * so loop doesn't sleep in epoll while there is traffic. Busy poll socket options need
+ * CAP_NET_ADMIN for values above net.core.busy_read, without them we still spin in user space.
+ */
+int init_ingest(struct ev_loop *loop) {
+    int prefer_busy_poll = 1;
+    int timestamps = 1;
+    int i = 0;
 
-    global.downstream.in_addr_new_ready = 0;
+    // virtual clock has nothing to do with kernel time
+    if (global.ingest.timestamps && global.clock == CLOCK_VIRTUAL) {
+        log_msg(WARN, "%s: receive_timestamps are ignored with virtual clock", __func__);
+        global.ingest.timestamps = 0;
+    }
+    global.ingest.load_window_start = ev_time();
+    // data_port is kept for old configs, without listen lines it is the only listener
+    if (global.data_port > 0 || global.listeners_num == 0) {
+        if (add_listener("0.0.0.0", global.data_port, NULL) == NULL) {
+            return 1;
+        }
+    }
+    for (i = 0; i < RECV_BATCH_SIZE; i++) {
+        // one byte is left for '\n' process_data_packet() may append
+        global.ingest.iovecs[i].iov_base = global.ingest.buffers + i * DATA_BUF_SIZE;
+        global.ingest.iovecs[i].iov_len = DATA_BUF_SIZE - 1;
+        memset(&(global.ingest.messages[i]), 0, sizeof(struct mmsghdr));
+        global.ingest.messages[i].msg_hdr.msg_iov = global.ingest.iovecs + i;
+        global.ingest.messages[i].msg_hdr.msg_iovlen = 1;
+        if (global.ingest.timestamps) {
+            global.ingest.messages[i].msg_hdr.msg_control = global.ingest.control[i];
+        }
+    }
+    for (i = 0; i < global.listeners_num; i++) {
+        if (init_listener(global.listeners + i) != 0) {
+            return 1;
+        }
+        if (global.ingest.timestamps && setsockopt(global.listeners[i].super.fd, SOL_SOCKET, SO_TIMESTAMPNS, &timestamps, sizeof(int)) != 0) {
+            log_msg(ERROR, "%s: setsockopt(SO_TIMESTAMPNS) failed %s", __func__, strerror(errno));
+            return 1;
+        }
+        if (global.ingest.busy_poll == 0) {
+            ev_io_start(loop, &(global.listeners[i].super));
+            continue;
+        }
+        if (setsockopt(global.listeners[i].super.fd, SOL_SOCKET, SO_BUSY_POLL, &(global.ingest.busy_poll), sizeof(int)) != 0) {
+            log_msg(WARN, "%s: setsockopt(SO_BUSY_POLL) failed %s", __func__, strerror(errno));
+        }
+        if (setsockopt(global.listeners[i].super.fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer_busy_poll, sizeof(int)) != 0) {
+            log_msg(WARN, "%s: setsockopt(SO_PREFER_BUSY_POLL) failed %s", __func__, strerror(errno));
+        }
+    }
+    if (global.ingest.busy_poll > 0) {
+        ev_idle_init(&(global.ingest.busy_poll_watcher), busy_poll_cb);
+        ev_idle_start(loop, &(global.ingest.busy_poll_watcher));
+        log_msg(INFO, "%s: busy polling data sockets, SO_BUSY_POLL %d us", __func__, global.ingest.busy_poll);
+    }
+    return 0;
 }
 
-int setnonblock(int fd) {
-    int flags = fcntl(fd, F_GETFL);
-    flags |= O_NONBLOCK;
-    return fcntl(fd, F_SETFL, flags);
+// function to parse filter line received from tap client
+// filter line looks like "<in|out|all> [prefix]"
+int tap_parse_filter(struct tap_client_s *client) {
+    char *prefix = memchr(client->filter, ' ', client->filter_length - 1);
+    int direction_length = (prefix == NULL ? client->filter_length : prefix - client->filter + 1) - 1;
+
+    if (direction_length == 2 && memcmp(client->filter, "in", 2) == 0) {
+        client->direction = TAP_IN;
+    } else if (direction_length == 3 && memcmp(client->filter, "out", 3) == 0) {
+        client->direction = TAP_OUT;
+    } else if (direction_length == 3 && memcmp(client->filter, "all", 3) == 0) {
+        client->direction = TAP_IN | TAP_OUT;
+    } else {
+        return 1;
+    }
+    client->prefix = client->filter + direction_length + 1;
+    client->prefix_length = (prefix == NULL) ? 0 : client->filter_length - direction_length - 2;
+    return 0;
+}
+
+void tap_client_read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    struct tap_client_s *client = (struct tap_client_s *)watcher;
+    char buffer[TAP_FILTER_BUF_SIZE];
+    char *buffer_ptr = buffer;
+    int n = 0;
+
+    if (client->ready == 1) {
+        // after filter is set we only wait for the client to disconnect, everything else is ignored
+        n = recv(watcher->fd, buffer, TAP_FILTER_BUF_SIZE, 0);
+    } else {
+        buffer_ptr = client->filter + client->filter_length;
+        n = recv(watcher->fd, buffer_ptr, TAP_FILTER_BUF_SIZE - client->filter_length, 0);
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (n <= 0) {
+        tap_client_close(loop, client);
+        return;
+    }
+    if (client->ready == 1) {
+        return;
+    }
+    client->filter_length += n;
+    if (memchr(buffer_ptr, '\n', n) == NULL) {
+        if (client->filter_length == TAP_FILTER_BUF_SIZE) {
+            log_msg(WARN, "%s: tap filter is too long", __func__);
+            tap_client_close(loop, client);
+        }
+        return;
+    }
+    client->filter_length = (char *)memchr(client->filter, '\n', client->filter_length) - client->filter + 1;
+    if (tap_parse_filter(client) != 0) {
+        log_msg(WARN, "%s: invalid tap filter \"%.*s\"", __func__, client->filter_length - 1, client->filter);
+        tap_client_close(loop, client);
+        return;
+    }
+    client->ready = 1;
+    global.tap.clients_ready++;
+    log_msg(INFO, "%s: tap client attached with filter \"%.*s\"", __func__, client->filter_length - 1, client->filter);
+}
+
+void tap_accept_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    struct tap_client_s *client = NULL;
+    int client_fd = accept(watcher->fd, NULL, NULL);
+    int sndbuf = TAP_SOCKET_SNDBUF;
+    int i = 0;
+
+    if (client_fd < 0) {
+        log_msg(WARN, "%s: accept() failed %s", __func__, strerror(errno));
+        return;
+    }
+    for (i = 0; i < MAX_TAP_CLIENTS; i++) {
+        if (global.tap.clients[i].used == 0) {
+            client = global.tap.clients + i;
+            break;
+        }
+    }
+    if (client == NULL) {
+        log_msg(WARN, "%s: too many tap clients", __func__);
+        close(client_fd);
+        return;
+    }
+    if (setnonblock(client_fd) == -1) {
+        log_msg(WARN, "%s: setnonblock() failed %s", __func__, strerror(errno));
+        close(client_fd);
+        return;
+    }
+    if (setsockopt(client_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) != 0) {
+        log_msg(WARN, "%s: setsockopt() failed %s", __func__, strerror(errno));
+    }
+    client->used = 1;
+    client->ready = 0;
+    client->filter_length = 0;
+    client->dropped = 0;
+    ev_io_init(&(client->super), tap_client_read_cb, client_fd, EV_READ);
+    ev_io_start(loop, &(client->super));
+}
+
+// function to create unix socket for debug tap clients
+int init_tap(struct ev_loop *loop) {
+    struct sockaddr_un addr;
+    int tap_socket = 0;
+
+    global.tap.clients_ready = 0;
+    if (global.tap.socket_path == NULL) {
+        return 0;
+    }
+    if (strlen(global.tap.socket_path) >= sizeof(addr.sun_path)) {
+        log_msg(ERROR, "%s: tap socket path is too long", __func__);
+        return 1;
+    }
+    if ((tap_socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        log_msg(ERROR, "%s: socket() failed %s", __func__, strerror(errno));
+        return 1;
+    }
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, global.tap.socket_path);
+    // socket file could be left by the previous run
+    unlink(global.tap.socket_path);
+    if (bind(tap_socket, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        log_msg(ERROR, "%s: bind() failed %s", __func__, strerror(errno));
+        close(tap_socket);
+        return 1;
+    }
+    if (listen(tap_socket, TAP_LISTEN_BACKLOG) != 0 || setnonblock(tap_socket) == -1) {
+        log_msg(ERROR, "%s: listen() failed %s", __func__, strerror(errno));
+        close(tap_socket);
+        return 1;
+    }
+    ev_io_init(&(global.tap.accept_watcher), tap_accept_cb, tap_socket, EV_READ);
+    ev_io_start(loop, &(global.tap.accept_watcher));
+    return 0;
+}
+
+/* function to register alias from line like "12 api.requests", name is sanitized the same way as
+ * names of data lines. Returns NULL on success or error message for the client.
+ */
+char *register_alias(char *line, int length) {
+    char name[DOWNSTREAM_BUF_SIZE];
+    struct alias_s *alias = NULL;
+    char *name_ptr = memchr(line, ' ', length);
+    char *ptr = line;
+    char *buffer = NULL;
+    int name_length = 0;
+    uint32_t hash = 0;
+    int id = 0;
+
+    if (name_ptr == NULL || name_ptr == line) {
+        return "line should look like <id> <name>";
+    }
+    while (ptr < name_ptr && *ptr >= '0' && *ptr <= '9' && id < MAX_ALIASES) {
+        id = id * 10 + *ptr++ - '0';
+    }
+    if (ptr != name_ptr || id >= MAX_ALIASES) {
+        return "id should be a number less than 32768";
+    }
+    name_ptr++;
+    name_length = line + length - name_ptr;
+    // same limit as for binary record, so that any value fits into slot
+    if (name_length == 0 || name_length + 1 + MAX_BINARY_VALUE_LENGTH >= DOWNSTREAM_BUF_SIZE - MAX_COUNTER_LENGTH) {
+        return "invalid name length";
+    }
+    if (memchr(name_ptr, ':', name_length) != NULL) {
+        return "name should not contain ':'";
+    }
+    memcpy(name, name_ptr, name_length);
+    if (global.sanitize_names) {
+        name_length = sanitize_name(name, name_length, &hash);
+        if (name_length == 0) {
+            return "name is empty after sanitizing";
+        }
+    } else {
+        hash = global.name_hasher->hash(name, name_length);
+    }
+    // from now on name includes ':'
+    name[name_length++] = ':';
+    if ((buffer = mem_alloc(name_length)) == NULL) {
+        return "out of memory";
+    }
+    memcpy(buffer, name, name_length);
+    alias = global.aliases.names + id;
+    if (alias->name != NULL) {
+        mem_free(alias->name, alias->name_length);
+    }
+    alias->name = buffer;
+    alias->name_length = name_length;
+    alias->hash = hash;
+    alias->table = NULL;
+    log_msg(DEBUG, "%s: alias %d is \"%.*s\"", __func__, id, name_length - 1, buffer);
+    return NULL;
+}
+
+void alias_client_close(struct ev_loop *loop, struct alias_client_s *client) {
+    ev_io_stop(loop, &(client->super));
+    close(client->super.fd);
+    client->used = 0;
+}
+
+// every complete line received from client is registered, client gets "ok" or "error <message>" line back
+void alias_client_read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    struct alias_client_s *client = (struct alias_client_s *)watcher;
+    char reply[ALIAS_LINE_BUF_SIZE];
+    char *delimiter_ptr = NULL;
+    char *error = NULL;
+    int line_length = 0;
+    int n = recv(watcher->fd, client->buffer + client->length, ALIAS_LINE_BUF_SIZE - client->length, 0);
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (n <= 0) {
+        alias_client_close(loop, client);
+        return;
+    }
+    client->length += n;
+    while ((delimiter_ptr = memchr(client->buffer, '\n', client->length)) != NULL) {
+        line_length = delimiter_ptr - client->buffer;
+        error = register_alias(client->buffer, line_length);
+        if (error == NULL) {
+            n = sprintf(reply, "ok\n");
+        } else {
+            log_msg(WARN, "%s: can't register alias \"%.*s\": %s", __func__, line_length, client->buffer, error);
+            n = snprintf(reply, ALIAS_LINE_BUF_SIZE, "error %s\n", error);
+        }
+        // replies are short, client not reading them loses them
+        send(watcher->fd, reply, n, MSG_NOSIGNAL);
+        client->length -= line_length + 1;
+        memmove(client->buffer, delimiter_ptr + 1, client->length);
+    }
+    if (client->length == ALIAS_LINE_BUF_SIZE) {
+        log_msg(WARN, "%s: alias line is too long", __func__);
+        alias_client_close(loop, client);
+    }
+}
+
+void alias_accept_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    struct alias_client_s *client = NULL;
+    int client_fd = accept(watcher->fd, NULL, NULL);
+    int i = 0;
+
+    if (client_fd < 0) {
+        log_msg(WARN, "%s: accept() failed %s", __func__, strerror(errno));
+        return;
+    }
+    for (i = 0; i < MAX_ALIAS_CLIENTS; i++) {
+        if (global.aliases.clients[i].used == 0) {
+            client = global.aliases.clients + i;
+            break;
+        }
+    }
+    if (client == NULL) {
+        log_msg(WARN, "%s: too many alias clients", __func__);
+        close(client_fd);
+        return;
+    }
+    if (setnonblock(client_fd) == -1) {
+        log_msg(WARN, "%s: setnonblock() failed %s", __func__, strerror(errno));
+        close(client_fd);
+        return;
+    }
+    client->used = 1;
+    client->length = 0;
+    ev_io_init(&(client->super), alias_client_read_cb, client_fd, EV_READ);
+    ev_io_start(loop, &(client->super));
+}
+
+// function to allocate alias table and create unix socket clients register aliases on
+int init_aliases(struct ev_loop *loop) {
+    struct sockaddr_un addr;
+    int alias_socket = 0;
+
+    if (global.aliases.socket_path == NULL) {
+        return 0;
+    }
+    if (strlen(global.aliases.socket_path) >= sizeof(addr.sun_path)) {
+        log_msg(ERROR, "%s: alias socket path is too long", __func__);
+        return 1;
+    }
+    global.aliases.names = mem_alloc(MAX_ALIASES * sizeof(struct alias_s));
+    if (global.aliases.names == NULL) {
+        return 1;
+    }
+    bzero(global.aliases.names, MAX_ALIASES * sizeof(struct alias_s));
+    if ((alias_socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        log_msg(ERROR, "%s: socket() failed %s", __func__, strerror(errno));
+        return 1;
+    }
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, global.aliases.socket_path);
+    // socket file could be left by the previous run
+    unlink(global.aliases.socket_path);
+    if (bind(alias_socket, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        log_msg(ERROR, "%s: bind() failed %s", __func__, strerror(errno));
+        close(alias_socket);
+        return 1;
+    }
+    if (listen(alias_socket, ALIAS_LISTEN_BACKLOG) != 0 || setnonblock(alias_socket) == -1) {
+        log_msg(ERROR, "%s: listen() failed %s", __func__, strerror(errno));
+        close(alias_socket);
+        return 1;
+    }
+    ev_io_init(&(global.aliases.accept_watcher), alias_accept_cb, alias_socket, EV_READ);
+    ev_io_start(loop, &(global.aliases.accept_watcher));
+    return 0;
 }
 
 void downstream_mark_down(struct ev_io *watcher) {
@@ -777,6 +3662,10 @@ void check_downstream_health(struct ev_loop *loop) {
         watcher = (struct ev_io *)health_client;
         health_fd = watcher->fd;
         if (health_fd > 0 && ev_is_active(watcher)) {
+            // virtual time runs faster than the real one, request in progress is not a failure
+            if (global.clock == CLOCK_VIRTUAL) {
+                continue;
+            }
             log_msg(WARN, "%s: previous health check request was not completed", __func__);
             ev_io_stop(loop, watcher);
             downstream_mark_down(watcher);
@@ -813,6 +3702,91 @@ void downstream_healthcheck_timer_cb(struct ev_loop *loop, struct ev_periodic *p
     check_downstream_health(loop);
 }
 
+/* this function moves virtual clock forward firing timers in order. All datagrams
+ * sent before the command are processed first, so the outcome is deterministic.
+ */
+void virtual_clock_advance(struct ev_loop *loop, ev_tstamp delta) {
+    struct virtual_clock_s *clock = &(global.virtual_clock);
+    ev_tstamp until = clock->now + delta;
+
+    udp_drain();
+    while (clock->next_health_check <= until || clock->next_flush <= until) {
+        if (clock->next_health_check <= clock->next_flush) {
+            clock->now = clock->next_health_check;
+            clock->next_health_check += global.downstream_health_check_interval;
+            downstream_healthcheck_timer_cb(loop, NULL, 0);
+        } else {
+            clock->now = clock->next_flush;
+            clock->next_flush += global.downstream_flush_interval;
+            downstream_flush_timer_cb(loop, NULL, 0);
+        }
+    }
+    clock->now = until;
+    log_msg(DEBUG, "%s: virtual clock is at %.3f", __func__, clock->now);
+}
+
+// function to process single virtual clock command
+void virtual_clock_command(struct ev_loop *loop, char *command) {
+    char *endptr = NULL;
+    double delta = 0;
+
+    if (strncmp(command, CLOCK_ADVANCE_COMMAND, STRLEN(CLOCK_ADVANCE_COMMAND)) == 0) {
+        errno = 0;
+        delta = strtod(command + STRLEN(CLOCK_ADVANCE_COMMAND), &endptr);
+        if (errno == 0 && *endptr == 0 && delta >= 0) {
+            virtual_clock_advance(loop, delta);
+            return;
+        }
+    }
+    log_msg(ERROR, "%s: invalid clock command \"%s\"", __func__, command);
+}
+
+void virtual_clock_read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    struct virtual_clock_s *clock = &(global.virtual_clock);
+    char *line = clock->command;
+    char *delimiter_ptr = NULL;
+    int n = read(watcher->fd, clock->command + clock->command_length, CLOCK_COMMAND_BUF_SIZE - clock->command_length - 1);
+
+    if (n <= 0) {
+        // whoever drives the clock is gone, there is nothing to do for us
+        log_msg(INFO, "%s: clock commands stream is closed", __func__);
+        exit(0);
+    }
+    clock->command_length += n;
+    while ((delimiter_ptr = memchr(line, '\n', clock->command_length - (line - clock->command))) != NULL) {
+        *delimiter_ptr = 0;
+        virtual_clock_command(loop, line);
+        line = delimiter_ptr + 1;
+    }
+    clock->command_length -= line - clock->command;
+    memmove(clock->command, line, clock->command_length);
+    if (clock->command_length == CLOCK_COMMAND_BUF_SIZE - 1) {
+        log_msg(ERROR, "%s: clock command is too long", __func__);
+        clock->command_length = 0;
+    }
+}
+
+// function to start virtual clock driven by commands from stdin
+int init_virtual_clock(struct ev_loop *loop) {
+    struct virtual_clock_s *clock = &(global.virtual_clock);
+
+    if (global.downstream_flush_interval <= 0 || global.downstream_health_check_interval <= 0) {
+        log_msg(ERROR, "%s: virtual clock requires positive timer intervals", __func__);
+        return 1;
+    }
+    clock->now = 0;
+    clock->next_flush = global.downstream_flush_interval;
+    clock->next_health_check = global.downstream_health_check_interval;
+    clock->command_length = 0;
+    ev_io_init(&(clock->command_watcher), virtual_clock_read_cb, STDIN_FILENO, EV_READ);
+    // commands should be processed after health check replies that arrived at the same time
+    ev_set_priority(&(clock->command_watcher), EV_MINPRI);
+    ev_io_start(loop, &(clock->command_watcher));
+    // real periodic timers fire at the start, let's do the same
+    downstream_healthcheck_timer_cb(loop, NULL, 0);
+    return 0;
+}
+
 // http://stackoverflow.com/questions/791982/determine-if-a-string-is-a-valid-ip-address-in-c
 int is_valid_ip_address(char *ip_addr) {
     struct sockaddr_in sa;
@@ -820,13 +3794,13 @@ int is_valid_ip_address(char *ip_addr) {
     return result != 0;
 }
 
+// test harnesses include this file and provide their own main()
+#ifndef STATSD_AGGREGATOR_NO_MAIN
 int main(int argc, char *argv[]) {
     struct ev_loop *loop = ev_default_loop(0);
-    int data_socket;
-    struct sockaddr_in addr;
-    struct ev_io socket_watcher;
     struct ev_periodic downstream_flush_timer_watcher;
     struct ev_periodic downstream_healthcheck_timer_watcher;
+    struct ev_periodic stats_timer_watcher;
     ev_tstamp downstream_flush_timer_at = 0.0;
     ev_tstamp downstream_healthcheck_timer_at = 0.0;
     pthread_t downstream_socket_refresh_thread;
@@ -839,36 +3813,64 @@ int main(int argc, char *argv[]) {
         log_msg(ERROR, "%s: init_config() failed", __func__);
         exit(1);
     }
+    if (init_cpu_affinity() != 0) {
+        log_msg(ERROR, "%s: init_cpu_affinity() failed", __func__);
+        exit(1);
+    }
+    if (init_memory() != 0) {
+        log_msg(ERROR, "%s: init_memory() failed", __func__);
+        exit(1);
+    }
+    if (init_lateness_window() != 0) {
+        log_msg(ERROR, "%s: init_lateness_window() failed", __func__);
+        exit(1);
+    }
 
-    if ((data_socket = socket(PF_INET, SOCK_DGRAM, 0)) < 0 ) {
-        log_msg(ERROR, "%s: socket() error %s", __func__, strerror(errno));
+    // if downstream is specified via ip address no need to run downstream_refresh()
+    if (! is_valid_ip_address(global.downstream.data_host)) {
+        pthread_create(&downstream_socket_refresh_thread, NULL, downstream_refresh, NULL);
+    }
+
+    if (init_tap(loop) != 0) {
+        log_msg(ERROR, "%s: init_tap() failed", __func__);
         return(1);
     }
-    bzero(&addr, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(global.data_port);
-    addr.sin_addr.s_addr = INADDR_ANY;
 
-    if (bind(data_socket, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
-        log_msg(ERROR, "%s: bind() failed %s", __func__, strerror(errno));
+    if (init_aliases(loop) != 0) {
+        log_msg(ERROR, "%s: init_aliases() failed", __func__);
         return(1);
     }
 
-    // if downstream is specified via ip address no need to run downstream_refresh()
-    if (! is_valid_ip_address(global.downstream.data_host)) {
-        pthread_create(&downstream_socket_refresh_thread, NULL, downstream_refresh, NULL);
+    if (init_ingest(loop) != 0) {
+        log_msg(ERROR, "%s: init_ingest() failed", __func__);
+        return(1);
     }
 
-    ev_io_init(&socket_watcher, udp_read_cb, data_socket, EV_READ);
-    ev_io_start(loop, &socket_watcher);
+    if (global.clock == CLOCK_VIRTUAL) {
+        if (init_virtual_clock(loop) != 0) {
+            log_msg(ERROR, "%s: init_virtual_clock() failed", __func__);
+            return(1);
+        }
+    } else {
+        ev_periodic_init (&downstream_flush_timer_watcher, downstream_flush_timer_cb, downstream_flush_timer_at, global.downstream_flush_interval, 0);
+        ev_periodic_start (loop, &downstream_flush_timer_watcher);
+
+        ev_periodic_init (&downstream_healthcheck_timer_watcher, downstream_healthcheck_timer_cb, downstream_healthcheck_timer_at, global.downstream_health_check_interval, 0);
+        ev_periodic_start (loop, &downstream_healthcheck_timer_watcher);
+    }
 
-    ev_periodic_init (&downstream_flush_timer_watcher, downstream_flush_timer_cb, downstream_flush_timer_at, global.downstream_flush_interval, 0);
-    ev_periodic_start (loop, &downstream_flush_timer_watcher);
+    if (global.stats.interval > 0) {
+        init_stats();
+        ev_periodic_init (&stats_timer_watcher, stats_timer_cb, 0.0, global.stats.interval, 0);
+        ev_periodic_start (loop, &stats_timer_watcher);
+    }
 
-    ev_periodic_init (&downstream_healthcheck_timer_watcher, downstream_healthcheck_timer_cb, downstream_healthcheck_timer_at, global.downstream_health_check_interval, 0);
-    ev_periodic_start (loop, &downstream_healthcheck_timer_watcher);
+    // memory taken so far is not given back, pressure is computed over memory allocated from now on
+    global.memory.baseline = global.memory.allocated;
+    update_memory_pressure();
 
     ev_loop(loop, 0);
     log_msg(ERROR, "%s: ev_loop() exited", __func__);
     return(0);
 }
+#endif
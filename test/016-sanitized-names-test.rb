@@ -0,0 +1,9 @@
+#!/usr/bin/env ruby
+
+require './statsd-aggregator-test-lib'
+
+set_config("sanitize_names", "1")
+send_data("a b/c:1|c\na  b/c:2|c\na$b\tc:3|ms\nab_c:4|ms\n")
+# names with nothing left after sanitizing are invalid
+send_data("$%:1|c\nok:1|c\n")
+send_data(binary_datagram(["$%", "c", 1], ["ok", "c", 2]))
@@ -0,0 +1,6 @@
+#!/usr/bin/env ruby
+
+require './statsd-aggregator-test-lib'
+
+set_config("listen", "127.0.0.1:#{IN_PORT},prefix=legacy.,rcvbuf=1048576")
+send_data("a.b:1|c\na.b:2|c\nc.d:3|ms\nx\nc.d:4|ms\n")
@@ -0,0 +1,9 @@
+#!/usr/bin/env ruby
+
+require './statsd-aggregator-test-lib'
+
+set_config("lateness_window", "1")
+send_data("ts.counter:1|c|T1\nts.counter:2|c|T0\nts.timer:5|ms|T1:7|ms\nts.plain:3|c\nts.future:1|c|T100\n")
+send_data("ts.rate:1|c|@0.5|T1\nts.bad:1|c|Tx\n")
+# values of one line go to the interval of its first timestamp
+send_data("ts.mixed:1|c|T1:2|c|T100\n")
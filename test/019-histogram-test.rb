@@ -0,0 +1,7 @@
+#!/usr/bin/env ruby
+
+require './statsd-aggregator-test-lib'
+
+set_config("histogram", "api.latency.:0.5,10,100")
+send_data("api.latency.get:0.2|h\napi.latency.get:10|h:11|h|@0.5\napi.latency.get:1000|h\napi.latency.put:7|d\n")
+send_data("api.latency.get:5|ms\napi.latency.get:x|h\napi.size.get:5|h\n")
@@ -0,0 +1,7 @@
+#!/usr/bin/env ruby
+
+require './statsd-aggregator-test-lib'
+
+set_config("quantize", "api.latency.:digits=3")
+send_data("api.latency.get:23.4817|ms\napi.latency.get:23.4517|ms:0.000123456|ms|@0.5\napi.latency.get:1234567|ms\n")
+send_data("api.latency.put:7.77777|h:1.5|g\napi.size.get:23.4817|ms\napi.latency.count:1.23456|c\n")
@@ -0,0 +1,7 @@
+#!/usr/bin/env ruby
+
+require './statsd-aggregator-test-lib'
+
+set_config("quantize", "db.:step=0.5")
+set_config("histogram", "db.query.:1,10")
+send_data("db.read:23.4817|ms\ndb.read:23.76|ms:0.1|ms:-0.3|ms\ndb.query.select:0.2|h:0.7|h\ndb.write:x|ms\n")
@@ -0,0 +1,6 @@
+#!/usr/bin/env ruby
+
+require './statsd-aggregator-test-lib'
+
+set_config("max_samples", "api.latency.:4")
+send_data("api.latency.get:5|ms:5|ms:5|ms:5|ms:5|ms\napi.latency.put:7|ms:9|ms|@0.5\napi.latency.get:x|ms\napi.requests:12|ms:13|ms\n")
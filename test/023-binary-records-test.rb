@@ -0,0 +1,6 @@
+#!/usr/bin/env ruby
+
+require './statsd-aggregator-test-lib'
+
+send_data(binary_datagram(["a.b", "c", 1], ["a.b", "c", 2, 0.5], ["c.d", "ms", 3.25], ["c.d", "ms", 4, 0.1], ["e.f", "g", -7]) + "\x03\x00x.y")
+send_data("a.b:1|c\nc.d:5|ms\n")
@@ -0,0 +1,12 @@
+#!/usr/bin/env ruby
+
+require './statsd-aggregator-test-lib'
+
+set_config("alias_socket", "/tmp/statsd-aggregator-alias.sock")
+register_alias(12, "api.requests")
+register_alias(7, "api.latency")
+send_data("#12:1|c\n#7:3|ms:4|ms\napi.requests:2|c\n#99:1|c\n#x:1|c\n")
+send_data(binary_datagram([12, "c", 5], [7, "ms", 6.5, 0.5], ["api.latency", "ms", 8]))
+# line with the id fits, with the registered name it doesn't
+register_alias(1, "a" * 1000)
+send_data("#1:#{"1" * 1000}|ms\n#1:1|c\n")
@@ -0,0 +1,12 @@
+#!/usr/bin/env ruby
+
+require './statsd-aggregator-test-lib'
+
+# 32 bins with fractional counts, every bin reserves the longest count it can have
+set_config("histogram", "h.:#{(1..31).to_a.join(",")}")
+values = (1..32).map {|v| "#{v}|h|@0.3" }.join(":")
+timer = "t:#{"1" * 44}|ms"
+# with 19 chars long name histogram doesn't fit into one packet, values are sent as is
+send_data("h.abcdefghijklmnopq:#{values}\n#{timer}\n")
+# with 12 chars long name it does, timer fills the rest of the packet
+send_data("h.abcdefghij:#{values}\n#{timer}\n")
@@ -0,0 +1,482 @@
+/**
+ * fuzz-parser: differential fuzzing of statsd-aggregator parser.
+ *
+ * Every input is processed as a single datagram by the real ingest path
+ * (process_data_packet()) and by the slow reference parser below, which
+ * follows the statsd format rules line by line without any shortcuts.
+ * Aggregates produced by both (counter sums and timer values per name) must
+ * match, otherwise the harness aborts.
+ *
+ * Build with libFuzzer:  clang -fsanitize=fuzzer,address ...
+ * Or standalone:         gcc -DFUZZ_STANDALONE ... and pass corpus files as arguments.
+**/
+
+#define STATSD_AGGREGATOR_NO_MAIN
+#include "../statsd-aggregator.c"
+
+#include <math.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+// reference parser is allowed to be slow, so names and values are kept in plain arrays
+#define REF_MAX_NAMES 1024
+#define REF_MAX_VALUES 1024
+
+struct ref_name_s {
+    char *name;
+    int name_length;
+    int type;
+    // set if both counter and other values came for the name. Result depends on
+    // packet boundaries in this case (type is pinned per output packet), such
+    // names are checked loosely
+    int mixed;
+    int counter_values;
+    double counter;
+    // sum of absolute values, used as a scale for comparison tolerance
+    double counter_scale;
+    char *values[REF_MAX_VALUES];
+    int values_length[REF_MAX_VALUES];
+    int values_num;
+};
+
+struct ref_s {
+    struct ref_name_s names[REF_MAX_NAMES];
+    int names_num;
+};
+
+struct ref_s reference;
+struct ref_s actual;
+// sanitized names of the reference are kept here
+char ref_names[DATA_BUF_SIZE * 2];
+int ref_names_length;
+// copies of output buffers, values of actual aggregates point into them
+char collected[DOWNSTREAM_BUF_NUM][DOWNSTREAM_BUF_SIZE];
+
+struct ref_name_s *ref_find_name(struct ref_s *ref, char *name, int name_length) {
+    struct ref_name_s *n = NULL;
+    int i = 0;
+
+    for (i = 0; i < ref->names_num; i++) {
+        n = ref->names + i;
+        if (n->name_length == name_length && memcmp(n->name, name, name_length) == 0) {
+            return n;
+        }
+    }
+    if (ref->names_num == REF_MAX_NAMES) {
+        fprintf(stderr, "too many names\n");
+        abort();
+    }
+    n = ref->names + ref->names_num++;
+    n->name = name;
+    n->name_length = name_length;
+    n->type = TYPE_UNKNOWN;
+    n->mixed = 0;
+    n->counter_values = 0;
+    n->counter = 0;
+    n->counter_scale = 0;
+    n->values_num = 0;
+    return n;
+}
+
+void ref_add_value(struct ref_name_s *n, char *value, int value_length) {
+    if (n->values_num == REF_MAX_VALUES) {
+        fprintf(stderr, "too many values\n");
+        abort();
+    }
+    n->values[n->values_num] = value;
+    n->values_length[n->values_num++] = value_length;
+}
+
+// function to parse "value|type[|@rate]" as statsd would. Segment ends with delimiter (':' or '\n')
+void ref_parse_value(struct ref_name_s *n, char *segment, int length) {
+    char *value_end = segment + length - 1;
+    char *bar = NULL;
+    char *rate_bar = NULL;
+    char *endptr = NULL;
+    int type = TYPE_OTHER;
+    double rate = 1;
+    double value = 0;
+    char *p = NULL;
+
+    for (p = segment; p < value_end; p++) {
+        if (*p == '|') {
+            bar = p;
+            break;
+        }
+    }
+    if (bar == NULL) {
+        return;
+    }
+    if (bar[1] == 'c') {
+        type = TYPE_COUNTER;
+    }
+    if (n->type == TYPE_UNKNOWN) {
+        n->type = type;
+    } else if (n->type != type) {
+        n->mixed = 1;
+        // for mixed names we need all values which could be emitted
+        if (type == TYPE_OTHER) {
+            ref_add_value(n, segment, value_end - segment);
+        }
+        return;
+    }
+    if (type == TYPE_OTHER) {
+        ref_add_value(n, segment, value_end - segment);
+        return;
+    }
+    for (p = bar + 1; p < value_end; p++) {
+        if (*p == '|') {
+            rate_bar = p;
+            break;
+        }
+    }
+    if (rate_bar != NULL && rate_bar[1] == '@') {
+        errno = 0;
+        rate = strtod(rate_bar + 2, &endptr);
+        if (errno != 0 || endptr != value_end) {
+            rate = 1;
+        }
+    }
+    errno = 0;
+    value = strtod(segment, &endptr);
+    if (errno != 0 || endptr != bar) {
+        return;
+    }
+    n->counter += value / rate;
+    n->counter_scale += fabs(value / rate);
+    n->counter_values++;
+}
+
+// function to sanitize name the way statsd does it with regular expressions:
+// whitespace runs become '_', '/' becomes '-', other unsafe characters are removed
+char *ref_sanitize_name(char *name, int *name_length) {
+    char collapsed[DATA_BUF_SIZE];
+    char *result = ref_names + ref_names_length;
+    int collapsed_length = 0;
+    int i = 0;
+    char c = 0;
+
+    for (i = 0; i < *name_length; i++) {
+        c = name[i];
+        if (c == ' ' || (c >= '\t' && c <= '\r')) {
+            if (collapsed_length == 0 || collapsed[collapsed_length - 1] != ' ') {
+                collapsed[collapsed_length++] = ' ';
+            }
+        } else {
+            collapsed[collapsed_length++] = c;
+        }
+    }
+    *name_length = 0;
+    for (i = 0; i < collapsed_length; i++) {
+        c = collapsed[i];
+        if (c == ' ') {
+            c = '_';
+        } else if (c == '/') {
+            c = '-';
+        }
+        if (isalnum((unsigned char)c) || c == '_' || c == '-' || c == '.') {
+            result[(*name_length)++] = c;
+        }
+    }
+    ref_names_length += *name_length;
+    return result;
+}
+
+// function to parse datagram the simplest possible way
+void ref_parse_packet(char *packet, int length) {
+    char *line = packet;
+    char *line_end = NULL;
+    char *colon = NULL;
+    char *segment = NULL;
+    char *p = NULL;
+    char *name = NULL;
+    int name_length = 0;
+    int line_length = 0;
+
+    while (line < packet + length) {
+        for (line_end = line; *line_end != '\n'; line_end++);
+        line_length = line_end - line + 1;
+        colon = NULL;
+        for (p = line; p < line_end; p++) {
+            if (*p == ':') {
+                colon = p;
+                break;
+            }
+        }
+        if (line_length > 6 && line_length < DOWNSTREAM_BUF_SIZE - MAX_COUNTER_LENGTH && colon != NULL) {
+            segment = colon + 1;
+            name = line;
+            name_length = colon - line;
+            if (global.sanitize_names) {
+                name = ref_sanitize_name(line, &name_length);
+            }
+            // nothing left of the name after sanitizing makes the line invalid
+            if (name_length == 0 && global.sanitize_names) {
+                line = line_end + 1;
+                continue;
+            }
+            for (p = segment; p <= line_end; p++) {
+                if (*p == ':' || p == line_end) {
+                    ref_parse_value(ref_find_name(&reference, name, name_length), segment, p - segment + 1);
+                    segment = p + 1;
+                }
+            }
+        }
+        line = line_end + 1;
+    }
+}
+
+// function to parse aggregated output which was sent to the downstream
+void actual_parse_buffer(char *buffer, int length) {
+    char *line = buffer;
+    char *line_end = NULL;
+    char *colon = NULL;
+    char *value = NULL;
+    char *value_end = NULL;
+    char *bar = NULL;
+    struct ref_name_s *n = NULL;
+
+    while (line < buffer + length) {
+        line_end = memchr(line, '\n', buffer + length - line);
+        colon = memchr(line, ':', line_end - line);
+        if (colon == NULL) {
+            fprintf(stderr, "output line without values \"%.*s\"\n", (int)(line_end - line), line);
+            abort();
+        }
+        n = ref_find_name(&actual, line, colon - line);
+        for (value = colon + 1; value < line_end; value = value_end + 1) {
+            value_end = memchr(value, ':', line_end - value);
+            if (value_end == NULL) {
+                value_end = line_end;
+            }
+            bar = memchr(value, '|', value_end - value);
+            if (bar != NULL && bar[1] == 'c') {
+                n->counter += strtod(value, NULL);
+                n->counter_values++;
+            } else {
+                ref_add_value(n, value, value_end - value);
+            }
+        }
+        line = line_end + 1;
+    }
+}
+
+// function to collect everything aggregator queued for the downstream
+void actual_collect() {
+    int idx = 0;
+    int collected_num = 0;
+    char *buffer = NULL;
+
+    if (global.downstream.slot_table.length > 0) {
+        downstream_schedule_flush(&(global.downstream.slot_table));
+    }
+    for (idx = global.downstream.flush_buffer_idx; idx != global.downstream.active_buffer_idx; idx = (idx + 1) % DOWNSTREAM_BUF_NUM) {
+        // collected data should stay valid till comparison, so it is copied
+        buffer = memcpy(collected[collected_num++], global.downstream.buffer + idx * DOWNSTREAM_BUF_SIZE, global.downstream.buffer_length[idx]);
+        actual_parse_buffer(buffer, global.downstream.buffer_length[idx]);
+        global.downstream.buffer_length[idx] = 0;
+    }
+    global.downstream.flush_buffer_idx = global.downstream.active_buffer_idx;
+    ev_io_stop(ev_default_loop(0), &(global.downstream.flush_watcher));
+}
+
+void mismatch(struct ref_name_s *n, char *reason) {
+    fprintf(stderr, "mismatch for \"%.*s\": %s\n", n->name_length, n->name, reason);
+    abort();
+}
+
+void compare_name(struct ref_name_s *expected, struct ref_name_s *got) {
+    int i = 0;
+    int j = 0;
+
+    if (expected->mixed) {
+        // every emitted value should be one of the values we've seen
+        for (i = 0; i < got->values_num; i++) {
+            for (j = 0; j < expected->values_num; j++) {
+                if (expected->values_length[j] == got->values_length[i] && memcmp(expected->values[j], got->values[i], got->values_length[i]) == 0) {
+                    break;
+                }
+            }
+            if (j == expected->values_num) {
+                mismatch(expected, "unexpected value");
+            }
+        }
+        return;
+    }
+    if ((expected->counter_values > 0) != (got->counter_values > 0)) {
+        mismatch(expected, "counter presence differs");
+    }
+    if (isfinite(expected->counter_scale) && fabs(expected->counter - got->counter) > 1e-9 * expected->counter_scale) {
+        fprintf(stderr, "expected %.17g, got %.17g\n", expected->counter, got->counter);
+        mismatch(expected, "counter sum differs");
+    }
+    if (expected->values_num != got->values_num) {
+        fprintf(stderr, "expected %d values, got %d\n", expected->values_num, got->values_num);
+        mismatch(expected, "number of values differs");
+    }
+    for (i = 0; i < expected->values_num; i++) {
+        if (expected->values_length[i] != got->values_length[i] || memcmp(expected->values[i], got->values[i], got->values_length[i]) != 0) {
+            fprintf(stderr, "expected \"%.*s\", got \"%.*s\"\n", expected->values_length[i], expected->values[i], got->values_length[i], got->values[i]);
+            mismatch(expected, "values differ");
+        }
+    }
+}
+
+void compare() {
+    struct ref_name_s *expected = NULL;
+    struct ref_name_s *got = NULL;
+    int names_num = actual.names_num;
+    int i = 0;
+
+    for (i = 0; i < reference.names_num; i++) {
+        expected = reference.names + i;
+        if (expected->counter_values == 0 && expected->values_num == 0) {
+            continue;
+        }
+        compare_name(expected, ref_find_name(&actual, expected->name, expected->name_length));
+    }
+    // names which aggregator emitted and reference didn't see
+    for (i = 0; i < names_num; i++) {
+        got = actual.names + i;
+        expected = ref_find_name(&reference, got->name, got->name_length);
+        if (expected->counter_values == 0 && expected->values_num == 0 && !expected->mixed) {
+            mismatch(got, "unexpected name");
+        }
+    }
+}
+
+void init_harness() {
+    static int initialized = 0;
+
+    if (initialized) {
+        return;
+    }
+    initialized = 1;
+    // messages about invalid input are expected, let's keep fuzzer output clean
+    global.log_level = ERROR + 1;
+    init_sanitize_table();
+    init_name_hasher("auto");
+    init_memory();
+    global.downstream.flush_watcher.fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+}
+
+// function to run single datagram through aggregator and reference parser
+void run_input(const uint8_t *data, int length) {
+    char packet[DATA_BUF_SIZE];
+    char reference_packet[DATA_BUF_SIZE];
+
+    memcpy(packet, data, length);
+    memcpy(reference_packet, data, length);
+    reference.names_num = 0;
+    actual.names_num = 0;
+    ref_names_length = 0;
+    process_data_packet(packet, length);
+    // binary datagrams have no text reference, they are only checked by sanitizers
+    if (data[0] == BINARY_MAGIC) {
+        actual_collect();
+        return;
+    }
+    if (reference_packet[length - 1] != '\n') {
+        reference_packet[length++] = '\n';
+    }
+    ref_parse_packet(reference_packet, length);
+    actual_collect();
+    compare();
+}
+
+// function to check that hash computed while sanitizing equals hash of the sanitized name
+void check_name_hash(const uint8_t *data, int length) {
+    char name[DATA_BUF_SIZE];
+    uint32_t hash = 0;
+    int name_length = 0;
+
+    memcpy(name, data, length);
+    name_length = sanitize_name(name, length, &hash);
+    if (hash != global.name_hasher->hash(name, name_length)) {
+        fprintf(stderr, "%s: hash of sanitized name differs\n", global.name_hasher->name);
+        abort();
+    }
+}
+
+// function to switch to the next name hasher supported by cpu
+void next_name_hasher() {
+    struct name_hasher_s *hasher = global.name_hasher;
+
+    do {
+        hasher++;
+        if (hasher->name == NULL) {
+            hasher = name_hashers;
+        }
+    } while (!hasher->supported());
+    global.name_hasher = hasher;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    int length = size;
+
+    init_harness();
+    // datagrams longer than buffer are truncated by recv()
+    if (length > DATA_BUF_SIZE - 1) {
+        length = DATA_BUF_SIZE - 1;
+    }
+    if (length == 0) {
+        return 0;
+    }
+    // every input is checked with and without name sanitizing, inputs are spread over all hashers
+    next_name_hasher();
+    check_name_hash(data, length);
+    global.sanitize_names = 0;
+    run_input(data, length);
+    global.sanitize_names = 1;
+    run_input(data, length);
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+// function to run single corpus file through the harness
+int run_file(char *path) {
+    struct stat st;
+    uint8_t *data = NULL;
+    FILE *f = NULL;
+
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    data = malloc(st.st_size + 1);
+    f = fopen(path, "rb");
+    if (f == NULL || fread(data, 1, st.st_size, f) != (size_t)st.st_size) {
+        fprintf(stderr, "can't read %s\n", path);
+        exit(1);
+    }
+    fclose(f);
+    LLVMFuzzerTestOneInput(data, st.st_size);
+    free(data);
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    char path[PATH_MAX];
+    struct dirent *entry = NULL;
+    DIR *dir = NULL;
+    int files = 0;
+    int i = 0;
+
+    for (i = 1; i < argc; i++) {
+        dir = opendir(argv[i]);
+        if (dir == NULL) {
+            files += run_file(argv[i]);
+            continue;
+        }
+        while ((entry = readdir(dir)) != NULL) {
+            snprintf(path, PATH_MAX, "%s/%s", argv[i], entry->d_name);
+            files += run_file(path);
+        }
+        closedir(dir);
+    }
+    printf("%d inputs processed, no mismatches\n", files);
+    return 0;
+}
+#endif
@@ -0,0 +1,169 @@
+/**
+ * hash-bench: collision quality and throughput of metric name hashers.
+ *
+ * Names are read from file (one per line), e.g. dump of names seen in
+ * production, or generated to look like typical statsd names 40-120 bytes long.
+ * For each hasher supported by cpu it reports hashing speed (alone and fused
+ * with sanitizing), number of full 32 bit collisions and how evenly names are
+ * spread over buckets of a power of two table (chi-square divided by degrees of
+ * freedom should be close to 1.0).
+**/
+
+#define STATSD_AGGREGATOR_NO_MAIN
+#include "../statsd-aggregator.c"
+
+#include <time.h>
+
+#define DEFAULT_NAMES_NUM 1000000
+#define MAX_NAME_LENGTH 1024
+#define ROUNDS 5
+
+char **names;
+int *names_length;
+int names_num;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void add_name(char *name, int length) {
+    names[names_num] = memcpy(malloc(length), name, length);
+    names_length[names_num++] = length;
+}
+
+// generated names look like service.dc.host-N.component.endpoint_N.metric.suffix
+void generate_names(int num) {
+    static char *services[] = { "api", "billing", "search", "frontend", "checkout-service", "recommendations" };
+    static char *components[] = { "http", "db.postgres", "cache.redis", "queue.kafka.consumer", "grpc.client" };
+    static char *metrics[] = { "latency", "requests", "errors.5xx", "bytes_sent", "pool.connections.active" };
+    static char *suffixes[] = { "count", "p99", "mean", "upper_90", "rate" };
+    char name[MAX_NAME_LENGTH];
+    int length = 0;
+    int i = 0;
+
+    srandom(1);
+    for (i = 0; i < num; i++) {
+        length = snprintf(name, MAX_NAME_LENGTH, "%s.dc%ld.host-%ld.%s.endpoint_%d.%s.%s",
+            services[random() % 6], random() % 4, random() % 2000, components[random() % 5],
+            i, metrics[random() % 5], suffixes[random() % 5]);
+        add_name(name, length);
+    }
+}
+
+void read_names(char *filename) {
+    char *line = NULL;
+    size_t n = 0;
+    int l = 0;
+    FILE *f = fopen(filename, "r");
+
+    if (f == NULL) {
+        fprintf(stderr, "fopen() failed %s\n", strerror(errno));
+        exit(1);
+    }
+    while ((l = getline(&line, &n, f)) > 0 && names_num < DEFAULT_NAMES_NUM * 10) {
+        if (line[l - 1] == '\n') {
+            l--;
+        }
+        if (l > 0) {
+            add_name(line, l);
+        }
+    }
+    free(line);
+    fclose(f);
+}
+
+int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(uint32_t *)a;
+    uint32_t y = *(uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+void bench_hasher(struct name_hasher_s *hasher, uint32_t *hashes, long bytes) {
+    char name[MAX_NAME_LENGTH];
+    uint32_t sink = 0;
+    uint32_t hash = 0;
+    long collisions = 0;
+    long *buckets = NULL;
+    long table_size = 1;
+    double chi2 = 0;
+    double expected = 0;
+    double start = 0;
+    double hash_time = 0;
+    double fused_time = 0;
+    int r = 0;
+    int i = 0;
+
+    global.name_hasher = hasher;
+    start = now();
+    for (r = 0; r < ROUNDS; r++) {
+        for (i = 0; i < names_num; i++) {
+            sink += hasher->hash(names[i], names_length[i]);
+        }
+    }
+    hash_time = (now() - start) / ROUNDS;
+    start = now();
+    for (r = 0; r < ROUNDS; r++) {
+        for (i = 0; i < names_num; i++) {
+            memcpy(name, names[i], names_length[i]);
+            sanitize_name(name, names_length[i], &hash);
+            sink += hash;
+        }
+    }
+    fused_time = (now() - start) / ROUNDS;
+    for (i = 0; i < names_num; i++) {
+        hashes[i] = hasher->hash(names[i], names_length[i]);
+    }
+    // bucket distribution for table with load factor between 0.25 and 0.5, same as slot index
+    while (table_size < names_num * 2L) {
+        table_size *= 2;
+    }
+    buckets = calloc(table_size, sizeof(long));
+    for (i = 0; i < names_num; i++) {
+        buckets[hashes[i] & (table_size - 1)]++;
+    }
+    expected = (double)names_num / table_size;
+    for (i = 0; i < table_size; i++) {
+        chi2 += (buckets[i] - expected) * (buckets[i] - expected) / expected;
+    }
+    free(buckets);
+    qsort(hashes, names_num, sizeof(uint32_t), compare_u32);
+    for (i = 1; i < names_num; i++) {
+        collisions += (hashes[i] == hashes[i - 1]);
+    }
+    printf("%-10s %8.1f ns/name %6.2f GB/s | sanitize+hash %8.1f ns/name | collisions %ld (expected %.1f) | chi2/df %.3f (%u)\n",
+        hasher->name, hash_time * 1e9 / names_num, bytes / hash_time / 1e9, fused_time * 1e9 / names_num,
+        collisions, (double)names_num * (names_num - 1) / 2 / 4294967296.0, chi2 / (table_size - 1), sink & 1);
+}
+
+int main(int argc, char *argv[]) {
+    struct name_hasher_s *hasher = NULL;
+    uint32_t *hashes = NULL;
+    long bytes = 0;
+    int i = 0;
+
+    names = malloc(sizeof(char *) * DEFAULT_NAMES_NUM * 10);
+    names_length = malloc(sizeof(int) * DEFAULT_NAMES_NUM * 10);
+    if (argc > 1) {
+        read_names(argv[1]);
+    } else {
+        generate_names(DEFAULT_NAMES_NUM);
+    }
+    global.log_level = ERROR + 1;
+    init_sanitize_table();
+    __builtin_cpu_init();
+    for (i = 0; i < names_num; i++) {
+        bytes += names_length[i];
+    }
+    printf("%d names, average length %.1f bytes\n", names_num, (double)bytes / names_num);
+    hashes = malloc(sizeof(uint32_t) * names_num);
+    for (hasher = name_hashers; hasher->name != NULL; hasher++) {
+        if (hasher->supported()) {
+            bench_hasher(hasher, hashes, bytes);
+        } else {
+            printf("%-10s is not supported by cpu\n", hasher->name);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,324 @@
+/**
+ * ingest-bench: speed of the datagram ingest path.
+ *
+ * Datagrams are generated from many distinct names (100000 by default) and fed
+ * directly into process_data_packet(), without sockets. Flushed buffers are
+ * thrown away. Huge pages mode of the memory region is set by -m, dTLB load
+ * misses per line are shown if perf events are available. With -b the same
+ * lines are also sent as binary records to compare binary ingest with text.
+**/
+
+#define STATSD_AGGREGATOR_NO_MAIN
+#include "../statsd-aggregator.c"
+#include "statsd-binary.h"
+
+#include <time.h>
+#include <sys/ioctl.h>
+
+#define DEFAULT_NAMES_NUM 100000
+#define DEFAULT_PACKETS_NUM 200000
+// generated datagrams are reused, so that reading them doesn't dominate cache and TLB misses
+#define PACKETS_POOL_SIZE 8192
+#define PACKET_SIZE 1400
+#define MAX_NAME_LENGTH 256
+#define ROUNDS 3
+// growth run starts with this many names, every GROWTH_NEW_NAME_EVERY-th line has a new name
+#define GROWTH_START_NAMES 1000
+#define GROWTH_NEW_NAME_EVERY 4
+
+char *packets;
+int *packets_length;
+// the same lines as binary records
+char *binary_packets;
+int *binary_packets_length;
+// the same lines with alias ids instead of names, text and binary
+char *alias_packets;
+int *alias_packets_length;
+char *binary_alias_packets;
+int *binary_alias_packets_length;
+int aliases;
+int packets_num = DEFAULT_PACKETS_NUM;
+int names_num = DEFAULT_NAMES_NUM;
+long lines_num;
+uint64_t dtlb_misses;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *services[] = { "api", "billing", "search", "frontend", "checkout-service", "recommendations" };
+static char *components[] = { "http", "db.postgres", "cache.redis", "queue.kafka.consumer", "grpc.client" };
+static char *metrics[] = { "latency", "requests", "errors.5xx", "bytes_sent", "pool.connections.active" };
+
+// names are like service.dc.host-N.component.endpoint_N.metric, function returns length of the name
+int format_name(char *name, int id) {
+    return snprintf(name, MAX_NAME_LENGTH, "%s.dc%d.host-%d.%s.endpoint_%d.%s",
+        services[id % 6], id % 4, id % 2000, components[id % 5], id, metrics[id % 5]);
+}
+
+// lines are counters and timers
+void generate_packets() {
+    char name[MAX_NAME_LENGTH];
+    char line[MAX_NAME_LENGTH + 16];
+    char *packet = NULL;
+    int name_length = 0;
+    int length = 0;
+    int id = 0;
+    int i = 0;
+
+    packets = malloc(PACKETS_POOL_SIZE * DATA_BUF_SIZE);
+    packets_length = calloc(PACKETS_POOL_SIZE, sizeof(int));
+    binary_packets = malloc(PACKETS_POOL_SIZE * DATA_BUF_SIZE);
+    binary_packets_length = calloc(PACKETS_POOL_SIZE, sizeof(int));
+    if (aliases) {
+        alias_packets = malloc(PACKETS_POOL_SIZE * DATA_BUF_SIZE);
+        alias_packets_length = calloc(PACKETS_POOL_SIZE, sizeof(int));
+        binary_alias_packets = malloc(PACKETS_POOL_SIZE * DATA_BUF_SIZE);
+        binary_alias_packets_length = calloc(PACKETS_POOL_SIZE, sizeof(int));
+    }
+    srandom(1);
+    for (i = 0; i < PACKETS_POOL_SIZE; i++) {
+        packet = packets + i * DATA_BUF_SIZE;
+        binary_packets_length[i] = statsd_binary_start(binary_packets + i * DATA_BUF_SIZE);
+        if (aliases) {
+            binary_alias_packets_length[i] = statsd_binary_start(binary_alias_packets + i * DATA_BUF_SIZE);
+        }
+        while (1) {
+            id = random() % names_num;
+            name_length = format_name(name, id);
+            length = snprintf(line, sizeof(line), "%s:%s\n", name, (id & 1) ? "1|c" : "7|ms");
+            if (packets_length[i] + length > PACKET_SIZE) {
+                break;
+            }
+            memcpy(packet + packets_length[i], line, length);
+            packets_length[i] += length;
+            // binary records are longer, but still fit into datagram of DATA_BUF_SIZE
+            binary_packets_length[i] = statsd_binary_record(binary_packets + i * DATA_BUF_SIZE, binary_packets_length[i],
+                DATA_BUF_SIZE, name, name_length, (id & 1) ? 'c' : 'm', (id & 1) ? 1 : 7, 1);
+            if (aliases) {
+                alias_packets_length[i] += sprintf(alias_packets + i * DATA_BUF_SIZE + alias_packets_length[i],
+                    "#%d:%s\n", id, (id & 1) ? "1|c" : "7|ms");
+                binary_alias_packets_length[i] = statsd_binary_alias_record(binary_alias_packets + i * DATA_BUF_SIZE,
+                    binary_alias_packets_length[i], DATA_BUF_SIZE, id, (id & 1) ? 'c' : 'm', (id & 1) ? 1 : 7, 1);
+            }
+            // pool is cycled, so each line is counted as many times as its packet is used
+            lines_num += packets_num / PACKETS_POOL_SIZE + (i < packets_num % PACKETS_POOL_SIZE);
+        }
+    }
+}
+
+// every generated name is registered as alias with id it was generated from
+int register_aliases() {
+    char line[MAX_NAME_LENGTH + 16];
+    int length = 0;
+    int id = 0;
+
+    global.aliases.names = mem_alloc(MAX_ALIASES * sizeof(struct alias_s));
+    if (global.aliases.names == NULL) {
+        return 1;
+    }
+    bzero(global.aliases.names, MAX_ALIASES * sizeof(struct alias_s));
+    for (id = 0; id < names_num; id++) {
+        length = sprintf(line, "%d ", id);
+        length += format_name(line + length, id);
+        if (register_alias(line, length) != NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// flushed buffers are not sent anywhere, they are just released
+void drop_flushed() {
+    int idx = 0;
+
+    for (idx = global.downstream.flush_buffer_idx; idx != global.downstream.active_buffer_idx; idx = (idx + 1) % DOWNSTREAM_BUF_NUM) {
+        global.downstream.buffer_length[idx] = 0;
+    }
+    global.downstream.flush_buffer_idx = global.downstream.active_buffer_idx;
+    ev_io_stop(ev_default_loop(0), &(global.downstream.flush_watcher));
+}
+
+double run(char *pool, int *pool_length) {
+    char buffer[DATA_BUF_SIZE];
+    double start = 0;
+    int i = 0;
+
+    ioctl(global.stats.dtlb_misses_fd, PERF_EVENT_IOC_RESET, 0);
+    start = now();
+    for (i = 0; i < packets_num; i++) {
+        memcpy(buffer, pool + (i % PACKETS_POOL_SIZE) * DATA_BUF_SIZE, pool_length[i % PACKETS_POOL_SIZE]);
+        process_data_packet(buffer, pool_length[i % PACKETS_POOL_SIZE]);
+        drop_flushed();
+    }
+    if (global.stats.dtlb_misses_fd < 0 || read(global.stats.dtlb_misses_fd, &dtlb_misses, sizeof(dtlb_misses)) != sizeof(dtlb_misses)) {
+        dtlb_misses = 0;
+    }
+    return now() - start;
+}
+
+// function to print the best of ROUNDS runs over the pool, label is padded to the same width
+void report(char *label, char *pool, int *pool_length) {
+    uint64_t best_dtlb_misses = 0;
+    double best = 0;
+    double t = 0;
+    int r = 0;
+
+    for (r = 0; r < ROUNDS; r++) {
+        t = run(pool, pool_length);
+        if (best == 0 || t < best) {
+            best = t;
+            best_dtlb_misses = dtlb_misses;
+        }
+    }
+    printf("%-19s: %7.1f ns/line %6.2f M lines/s", label, best * 1e9 / lines_num, lines_num / best / 1e6);
+    if (global.stats.dtlb_misses_fd >= 0) {
+        printf(" %6.3f dTLB misses/line", (double)best_dtlb_misses / lines_num);
+    }
+    printf("\n");
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+// function to print percentiles of per line latencies of datagrams sent while names were in [from, to)
+void report_growth(int from, int to, double *latencies, int num) {
+    char label[32];
+
+    if (num == 0) {
+        return;
+    }
+    qsort(latencies, num, sizeof(double), compare_double);
+    snprintf(label, sizeof(label), "%d-%d", from, to);
+    printf("%-15s %9d %7.1f %7.1f %7.1f %7.1f %8.1f\n", label, num, latencies[num / 2], latencies[(int)(num * 0.99)],
+        latencies[(int)(num * 0.999)], latencies[(int)(num * 0.9999)], latencies[num - 1]);
+}
+
+/* function to feed datagrams while number of distinct names grows from GROWTH_START_NAMES to names_num,
+ * only processing of the datagram is timed, its generation and dropping of flushed buffers are not
+ */
+void growth() {
+    char buffer[DATA_BUF_SIZE];
+    char name[MAX_NAME_LENGTH];
+    double *latencies = NULL;
+    double start = 0;
+    int latencies_size = 1024;
+    int latencies_num = 0;
+    int phase_start = 0;
+    int phase_names = GROWTH_START_NAMES;
+    int names = GROWTH_START_NAMES;
+    int length = 0;
+    int lines = 0;
+    int line_length = 0;
+    int id = 0;
+
+    latencies = malloc(latencies_size * sizeof(double));
+    printf("names grow from %d to %d, every %d-th line has a new name, ns/line of datagram\n", GROWTH_START_NAMES,
+        names_num, GROWTH_NEW_NAME_EVERY);
+    printf("%-15s %9s %7s %7s %7s %7s %8s\n", "names", "datagrams", "p50", "p99", "p99.9", "p99.99", "max");
+    srandom(1);
+    while (names < names_num) {
+        length = 0;
+        lines = 0;
+        while (1) {
+            id = (lines % GROWTH_NEW_NAME_EVERY == 0 && names < names_num) ? names : random() % names;
+            line_length = format_name(name, id);
+            if (length + line_length + 6 > PACKET_SIZE) {
+                break;
+            }
+            length += sprintf(buffer + length, "%s:%s\n", name, (id & 1) ? "1|c" : "7|ms");
+            names += (id == names);
+            lines++;
+        }
+        start = now();
+        process_data_packet(buffer, length);
+        if (latencies_num == latencies_size) {
+            latencies_size *= 2;
+            latencies = realloc(latencies, latencies_size * sizeof(double));
+        }
+        latencies[latencies_num++] = (now() - start) * 1e9 / lines;
+        drop_flushed();
+        if (names >= phase_names * 10 || names >= names_num) {
+            report_growth(phase_names, names, latencies + phase_start, latencies_num - phase_start);
+            phase_start = latencies_num;
+            phase_names = names;
+        }
+    }
+    free(latencies);
+}
+
+int main(int argc, char *argv[]) {
+    char *huge_pages[] = { "none", "transparent", "explicit" };
+    char config_line[64];
+    int binary = 0;
+    int grow = 0;
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, "abgk:m:n:s")) != -1) {
+        switch (opt) {
+            case 'a':
+                aliases = 1;
+                break;
+            case 'b':
+                binary = 1;
+                break;
+            case 'g':
+                grow = 1;
+                break;
+            case 'k':
+                names_num = atoi(optarg);
+                break;
+            case 'm':
+                // same values as huge_pages option of the config file
+                snprintf(config_line, sizeof(config_line), "huge_pages=%s", optarg);
+                if (process_config_line(config_line) != 0) {
+                    return 1;
+                }
+                break;
+            case 'n':
+                packets_num = atoi(optarg);
+                break;
+            case 's':
+                global.sanitize_names = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-k names] [-n packets] [-m none|transparent|explicit] [-s] [-b] [-a] [-g]\n", argv[0]);
+                return 1;
+        }
+    }
+    global.log_level = WARN;
+    init_sanitize_table();
+    init_name_hasher("auto");
+    if (init_memory() != 0) {
+        return 1;
+    }
+    init_stats();
+    if (aliases && (names_num > MAX_ALIASES || register_aliases() != 0)) {
+        fprintf(stderr, "aliases need at most %d names\n", MAX_ALIASES);
+        return 1;
+    }
+    global.log_level = ERROR + 1;
+    global.downstream.flush_watcher.fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (grow) {
+        growth();
+        return 0;
+    }
+    generate_packets();
+    printf("%d packets, %ld lines, %d names, hash %s%s, huge pages %s\n", packets_num, lines_num, names_num,
+        global.name_hasher->name, global.sanitize_names ? ", sanitized" : "", huge_pages[global.memory.huge_pages]);
+    report("text lines", packets, packets_length);
+    if (binary) {
+        report("binary records", binary_packets, binary_packets_length);
+    }
+    if (aliases) {
+        report("alias lines", alias_packets, alias_packets_length);
+        report("binary aliases", binary_alias_packets, binary_alias_packets_length);
+    }
+    return 0;
+}
@@ -0,0 +1,26 @@
+#!/usr/bin/env ruby
+
+# This script builds seed corpus for fuzz-parser from the existing tests.
+# Every send_data() call of every test becomes a separate corpus file.
+
+require './statsd-binary'
+
+CORPUS_DIR = ARGV[0] || "fuzz-corpus"
+# tests refer to the port of the aggregator in config
+IN_PORT = 9000
+
+Dir.mkdir(CORPUS_DIR) unless Dir.exist?(CORPUS_DIR)
+
+Dir.glob("*-test.rb").sort.each do |test|
+    packets = []
+    # tests are plain ruby, we only need to replace the library with the collector
+    sandbox = Object.new
+    sandbox.define_singleton_method(:send_data) {|data| packets << data }
+    sandbox.define_singleton_method(:set_test_timeout) {|t| }
+    sandbox.define_singleton_method(:set_config) {|name, value| }
+    sandbox.define_singleton_method(:register_alias) {|id, name| }
+    sandbox.instance_eval(File.read(test).gsub(/^require .*$/, ""), test)
+    packets.each_with_index do |data, i|
+        File.binwrite(File.join(CORPUS_DIR, "#{File.basename(test, ".rb")}-#{i}"), data)
+    end
+end
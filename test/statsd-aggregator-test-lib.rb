@@ -10,6 +10,8 @@
 # simulator.
 
 require 'eventmachine'
+require 'socket'
+require './statsd-binary'
 
 # port statsd aggregator listens on
 IN_PORT = 9000
@@ -23,6 +25,9 @@ CONFIG_FILE = "/tmp/statsd-aggregator.conf"
 EXE_FILE = "../statsd-aggregator"
 # how often statsd aggregator flushes data to downstreams
 FLUSH_INTERVAL = 2.0
+# statsd aggregator timers are driven by the virtual clock, test advances it
+# right after sending data instead of waiting for the real flush
+CLOCK = "virtual"
 
 # test exit code in case of success
 SUCCESS_EXIT_STATUS = 0
@@ -35,6 +40,13 @@ DEFAULT_TEST_TIMEOUT = 20
 MIN_METRICS_LENGTH = 6
 MAX_METRICS_LENGTH = 1450
 MAX_COUNTER_LENGTH = 18 # because of "%.15g|c\n"
+MAX_BIN_COUNT_LENGTH = 25 # because of any "%.15g|c\n", bin counts are fractional with sample rates
+MAX_SAMPLE_LENGTH = 40 # because of "%.15g|ms|@%.6g:"
+# type, value and rate of binary record
+BINARY_VALUE_SIZE = 17
+MAX_ALIASES = 32768
+# DogStatsD style timestamp of the value
+TIMESTAMP_PATTERN = /\|T(\d+)(?=[:|]|$)/
 
 # we are extending String class with numeric? method
 # it should return true if string is float number, false otherwise
@@ -74,24 +86,38 @@ end
 # statsd-aggregatr simulator
 # it is using same logic as c version
 class StatsdAggregator
-    def initialize(statsd_aggregator_test)
+    # suffix is appended to every value on flush, it is "|T<interval start>" for lateness window tables
+    def initialize(statsd_aggregator_test, suffix = "")
         # each slot corresponds to the metric, data with same metric name should go to one and the same slot
         @slots = []
         # how much data we have ready for transfer to the downstream
         @active_buffer_length = 0
         @sat = statsd_aggregator_test
+        @suffix = suffix
+        # lateness window tables by interval number
+        @tables = {}
     end
 
     # simulates flushing data to the downstream
     def flush()
         # let's filter out slots with data
-        slots_with_data = @slots.select {|s| ! s[:values].empty? }
+        slots_with_data = @slots.select {|s| ! s[:values].empty? || s[:bins] || s[:samples] }
+        # histogram is sent as one counter per bin
+        slots_with_data = slots_with_data.flat_map do |s|
+            next [s.merge(values: sampled_values(s))] if s[:samples]
+            next [s] if ! s[:bins]
+            s[:bins].each_with_index.map {|count, i| {name: "#{s[:name]}.bin_#{histogram_labels(s[:name])[i]}", values: [sprintf("%.15g|c", count)]} }
+        end
         if ! slots_with_data.empty?
             # event, which we 
-            @sat.expect({source: "network", data: slots_with_data})
+            @sat.expect({source: "network", data: slots_with_data.map {|s| s.merge(values: s[:values].map {|v| v + @suffix }) }})
         end
         @slots = []
         @active_buffer_length = 0
+        # virtual clock is advanced right after flush, test sends everything within first interval,
+        # so all lateness window tables are closed
+        @tables.each_value {|t| t.flush() }
+        @tables = {}
     end
 
     # find slot with given name or create new slot, return index of the slot
@@ -114,6 +140,68 @@ class StatsdAggregator
         @slots.size - 1
     end
 
+    # settings of the longest prefix name starts with, histogram, quantize and max_samples configs look like prefix:settings
+    def rule(name)
+        rules = {}
+        ["histogram", "quantize", "max_samples"].each do |k|
+            next if ! @sat.config.key?(k)
+            prefix, settings = @sat.config[k].split(":", 2)
+            (rules[prefix] ||= {})[k.to_sym] = settings
+        end
+        prefix = rules.keys.select {|p| name.start_with?(p) }.max_by(&:size)
+        prefix ? rules[prefix] : {}
+    end
+
+    def histogram_bounds(name)
+        rule(name)[:histogram].to_s.split(",")
+    end
+
+    def histogram_labels(name)
+        histogram_bounds(name).map {|b| b.tr(".", "_") } + ["inf"]
+    end
+
+    # every bin is "<name>.bin_<label>:%.15g|c<suffix>\n"
+    def histogram_length(name)
+        histogram_labels(name).map {|l| name.size + ".bin_".size + l.size + 1 + MAX_BIN_COUNT_LENGTH + @suffix.size }.sum
+    end
+
+    # |h and |d values of the name are aggregated into histogram if it matches histogram prefix and fits into packet
+    def histogram?(slot)
+        return slot[:type] == "histogram" if slot[:type] != "unknown"
+        rule(slot[:name])[:histogram] && histogram_length(slot[:name]) <= MAX_METRICS_LENGTH
+    end
+
+    # timer values of the name are sampled if it matches max_samples prefix and all kept values fit into packet
+    def sampled?(slot)
+        return slot[:type] == "sampled" if slot[:type] != "unknown"
+        rule(slot[:name])[:max_samples] && slot[:name].size + 1 + rule(slot[:name])[:max_samples].to_i * (MAX_SAMPLE_LENGTH + @suffix.size) <= MAX_METRICS_LENGTH
+    end
+
+    # kept values are sent with rate scaled by share of values kept. Reservoir replaces random values,
+    # simulator keeps the first ones, so tests send the same value once reservoir is full
+    def sampled_values(slot)
+        slot[:samples].map do |value, rate|
+            rate = rate * slot[:samples].size / slot[:seen]
+            sprintf("%.15g|ms", value) + (rate != 1 ? sprintf("|@%.6g", rate) : "")
+        end
+    end
+
+    # timer, |h and |d values are rounded to configured significant digits or step
+    def quantize(name, m)
+        value, type = m.split("|", 2)
+        quantize = rule(name)[:quantize]
+        return m if ! quantize || ! value.numeric? || ! ["m", "h", "d"].include?(type[0])
+        option, n = quantize.split("=")
+        if option == "digits"
+            q = sprintf("%.#{n}g", value.to_f)
+            # large values like 1.23e+06 are shorter without exponent
+            plain = sprintf("%.0f", q.to_f)
+            q = plain if q.include?("e") && value.to_f.abs < 1e15 && plain.size < q.size
+            return q + "|" + type
+        end
+        sprintf("%.15g", (value.to_f / n.to_f).round * n.to_f) + "|" + type
+    end
+
     def insert_values_into_slot(slot_idx, metric)
         slot = @slots[slot_idx]
         # metric is an array [metric_name, metric_value_0, ... metric_value_N]
@@ -129,6 +217,10 @@ class StatsdAggregator
             metric_type = "other"
             if a[1] == "c"
                 metric_type = "counter"
+            elsif (a[1] == "h" || a[1] == "d") && histogram?(slot)
+                metric_type = "histogram"
+            elsif a[1] == "ms" && sampled?(slot)
+                metric_type = "sampled"
             end
             if slot[:type] == "unknown"
                 # this is newly created slot, setting type
@@ -137,11 +229,20 @@ class StatsdAggregator
                 # this is existing slot with known type, is new type ok?
                 if slot[:type] != metric_type
                     # bad type
-                    @sat.expect({source: "stdout", data: "got improper metric type for \"#{name}\""})
+                    @sat.expect({source: "stdout", data: "got improper metric type for \"#{name}:\""})
                     next
                 end
             end
-            if @active_buffer_length + (metric_type == "counter" ? MAX_COUNTER_LENGTH : m.size + 1) > MAX_METRICS_LENGTH
+            m = quantize(name, m) if metric_type == "other" || metric_type == "sampled"
+            value_length = case metric_type
+                when "counter" then MAX_COUNTER_LENGTH + @suffix.size
+                # histogram takes its fixed output length with the first value
+                when "histogram" then slot[:bins] ? 0 : histogram_length(name) - (name.size + 1)
+                # sampled slot takes maximum length of every kept value
+                when "sampled" then slot[:seen].to_i < rule(name)[:max_samples].to_i ? MAX_SAMPLE_LENGTH + @suffix.size : 0
+                else m.size + 1 + @suffix.size
+            end
+            if @active_buffer_length + value_length > MAX_METRICS_LENGTH
                 # we have enough data, let's flush
                 flush()
                 # flush() resets slots, need to create new slot
@@ -149,14 +250,36 @@ class StatsdAggregator
                 @active_buffer_length += (name.size + 1)
                 slot = @slots[0]
             end
-            if metric_type == "counter"
-                # counters are treated differently
-                # default rate is 1.0
-                rate = 1.0
-                if a[2] != nil && a[2][0] == "@" && a[2][1..-1].numeric?
-                    # if rate value is valid - use it
-                    rate = a[2][1..-1].to_f
+            # default rate is 1.0
+            rate = 1.0
+            if a[2] != nil && a[2][0] == "@" && a[2][1..-1].numeric?
+                # if rate value is valid - use it
+                rate = a[2][1..-1].to_f
+            end
+            if metric_type == "histogram"
+                if ! a[0].numeric?
+                    @sat.expect({source: "stdout", data: "invalid value in histogram data \"#{m}\""})
+                else
+                    if ! slot[:bins]
+                        slot[:bins] = [0.0] * histogram_labels(name).size
+                        @active_buffer_length += histogram_length(name) - (name.size + 1)
+                    end
+                    # value goes to the first bin with bound not less than the value
+                    slot[:bins][histogram_bounds(name).count {|b| b.to_f < a[0].to_f }] += 1.0 / rate
+                end
+            elsif metric_type == "sampled"
+                if ! a[0].numeric?
+                    @sat.expect({source: "stdout", data: "invalid value in timer data \"#{m}\""})
+                else
+                    slot[:samples] ||= []
+                    slot[:seen] = slot[:seen].to_i + 1
+                    if slot[:samples].size < rule(name)[:max_samples].to_i
+                        slot[:samples] << [m.split("|")[0].to_f, rate]
+                        @active_buffer_length += MAX_SAMPLE_LENGTH + @suffix.size
+                    end
                 end
+            elsif metric_type == "counter"
+                # counters are treated differently
                 if ! a[0].numeric?
                     # metric value should be numerical, otherwise it's invalid
                     @sat.expect({source: "stdout", data: "invalid value in counter data \"#{m}\""})
@@ -164,6 +287,9 @@ class StatsdAggregator
                     if slot[:values][0] != nil
                         # if this is not 1st value we need to subtract data length from total length
                         @active_buffer_length -= (sprintf("%.15g|c", slot[:counter]).to_s.size + 1)
+                    else
+                        # counter has single value, so suffix is accounted once
+                        @active_buffer_length += @suffix.size
                     end
                     # counter value is updated
                     slot[:counter] += (a[0].to_f / rate)
@@ -175,11 +301,16 @@ class StatsdAggregator
             else
                 # this is not counter, just append it to the list of values
                 slot[:values] << m
-                @active_buffer_length += (m.size + 1)
+                @active_buffer_length += (m.size + 1 + @suffix.size)
             end
         end
     end
 
+    # makes name graphite compatible same way statsd does it
+    def sanitize(name)
+        name.gsub(/\s+/, "_").gsub("/", "-").gsub(/[^a-zA-Z_\-0-9\.]/, "")
+    end
+
     # processing of single metrics line
     def process_line(s)
         a = s.split(":")
@@ -187,14 +318,84 @@ class StatsdAggregator
             # no : means no metrics data
             @sat.expect({source: "stdout", data: "invalid metric #{s}"})
         else
+            name, data = s.split(":", 2)
+            if @sat.config.key?("alias_socket") && name.start_with?("#")
+                # line keyed by alias id gets registered name
+                id = name[1..-1]
+                if id !~ /\A\d+\z/ || id.to_i >= MAX_ALIASES
+                    @sat.expect({source: "stdout", data: "invalid metric #{s}"})
+                elsif ! @sat.aliases.key?(id.to_i)
+                    @sat.expect({source: "stdout", data: "unknown alias #{id.to_i}"})
+                else
+                    line = "#{@sat.aliases[id.to_i]}:#{data}"
+                    # line with registered name should fit the same size range
+                    if line.size > MAX_METRICS_LENGTH
+                        @sat.expect({source: "stdout", data: "invalid length #{line.size} of metric #{s}"})
+                    else
+                        process_line(line)
+                    end
+                end
+                return
+            end
+            if @sat.config["lateness_window"].to_i > 0 && data =~ TIMESTAMP_PATTERN
+                # line with explicit timestamp goes to the table of its interval with timestamps removed
+                table = timestamped_table($1.to_i)
+                table.process_line("#{name}:#{data.gsub(TIMESTAMP_PATTERN, "")}") if table
+                return
+            end
+            if @sat.config["sanitize_names"] == "1"
+                a[0] = sanitize(a[0])
+                # name with nothing left after sanitizing is invalid
+                return @sat.expect({source: "stdout", data: "invalid metric #{s}"}) if a[0].empty?
+            end
             slot_idx = find_slot(a[0])
             insert_values_into_slot(slot_idx, a)
         end
     end
 
+    # lateness window table for the timestamp, nil if it is out of the window
+    # virtual clock stays at 0 while test sends data
+    def timestamped_table(timestamp)
+        interval = (timestamp / FLUSH_INTERVAL).floor
+        return nil if interval > 0 || interval <= -@sat.config["lateness_window"].to_i
+        @tables[interval] ||= StatsdAggregator.new(@sat, "|T#{(interval * FLUSH_INTERVAL).floor}")
+    end
+
+    # binary records are processed as text lines with value and rate written as "%.15g"
+    def read_binary(data, prefix)
+        offset = 0
+        while offset < data.size
+            length = data[offset, 2].to_s.unpack1("v")
+            id = nil
+            if length && length & 0x8000 != 0 && @sat.config.key?("alias_socket")
+                id = length & 0x7fff
+                length = 0
+            end
+            if length.nil? || data.size - offset < 2 + length + BINARY_VALUE_SIZE
+                @sat.expect({source: "stdout", data: "truncated binary record at offset #{offset}"})
+                break
+            end
+            name = id ? "##{id}" : prefix + data[offset + 2, length]
+            type = data[offset + 2 + length]
+            value, rate = data[offset + 3 + length, 16].unpack("E2")
+            rate = 1.0 if ! (rate > 0) || ! rate.finite?
+            offset += 2 + length + BINARY_VALUE_SIZE
+            if ! id && @sat.config["sanitize_names"] == "1" && sanitize(name).empty?
+                @sat.expect({source: "stdout", data: "name of binary record is empty after sanitizing"})
+                next
+            end
+            process_line("#{name}:#{sprintf("%.15g", value)}|#{type == "m" ? "ms" : type}" + (rate != 1 ? sprintf("|@%.15g", rate) : ""))
+        end
+    end
+
     # simulate network data read
     def read(data)
+        # listener prefix is prepended to every line before any other processing
+        prefix = @sat.config["listen"].to_s[/,prefix=([^,]*)/, 1].to_s
+        return read_binary(data.b[1..-1], prefix) if data.getbyte(0) == BINARY_MAGIC
         data.split("\n").each do |s|
+            # names of aliases are used as registered
+            s = prefix + s unless s.start_with?("#") && @sat.config.key?("alias_socket")
             # metrics lines should fit certain size range
             if s.size.between?(MIN_METRICS_LENGTH, MAX_METRICS_LENGTH)
                 process_line(s)
@@ -206,7 +407,15 @@ class StatsdAggregator
 end
 
 class StatsdAggregatorTest
-    attr_accessor :timeout, :test_sequence, :health_check_done
+    attr_accessor :timeout, :test_sequence, :health_check_done, :config, :aliases
+
+    # this function registers name alias over control socket and waits for the reply
+    def register_alias_impl(line)
+        reply = UNIXSocket.open(@config["alias_socket"]) {|s| s.write("#{line}\n"); s.gets }
+        die("alias \"#{line}\" is not registered: #{reply}") if reply != "ok\n"
+        id, name = line.split(" ", 2)
+        @aliases[id.to_i] = @config["sanitize_names"] == "1" ? @sa.sanitize(name) : name
+    end
 
     # this function sends data during test execution
     def send_data_impl(data)
@@ -226,9 +435,14 @@ class StatsdAggregatorTest
         # now we need to generate config for statsd-aggregator for test run
         File.open(CONFIG_FILE, "w") do |f|
             f.puts("log_level=4")
-            f.puts("data_port=#{IN_PORT}")
+            # test can listen on IN_PORT with its own listener options instead
+            f.puts("data_port=#{IN_PORT}") unless @config.key?("listen")
             f.puts("downstream_flush_interval=#{FLUSH_INTERVAL}")
-            f.puts("downstream=localhost:#{OUT_PORT}:#{HEALTH_PORT}")
+            f.puts("clock=#{CLOCK}")
+            # ip address is used to avoid dns resolution
+            f.puts("downstream=127.0.0.1:#{OUT_PORT}:#{HEALTH_PORT}")
+            # test specific parameters
+            @config.each {|k, v| f.puts("#{k}=#{v}") }
         end
         # socket for sending data
         @data_socket = UDPSocket.new
@@ -240,7 +454,7 @@ class StatsdAggregatorTest
             # let's start downstream
             EventMachine::open_datagram_socket('0.0.0.0', OUT_PORT, OutputHandler, self, "network")
             # start statsd aggregator
-            EventMachine.popen("#{EXE_FILE} #{CONFIG_FILE}", OutputHandler, self, "stdout")
+            @aggregator = EventMachine.popen("#{EXE_FILE} #{CONFIG_FILE}", OutputHandler, self, "stdout")
             # and set timer to interrupt test in case of timeout
             EventMachine.add_timer(@timeout) do
                 die("Timeout. Stdout: #{@stdout}, expected events: #{@expected_events}")
@@ -260,6 +474,8 @@ class StatsdAggregatorTest
                         send(method, run_data[1])
                     end
                     @sa.flush()
+                    # all data is sent, let's move clock to the next flush
+                    @aggregator.send_data("advance #{FLUSH_INTERVAL}\n") if CLOCK == "virtual"
                     if @expected_events.empty? && @stdout.empty?
                         EventMachine.stop()
                         exit(SUCCESS_EXIT_STATUS)
@@ -278,6 +494,8 @@ class StatsdAggregatorTest
         @stdout = ""
         @id = 0
         @health_check_done = false
+        @config = {}
+        @aliases = {}
     end
 
     # called by simulator to add expected events
@@ -309,6 +527,7 @@ class StatsdAggregatorTest
                     end
                 end
             when "network"
+                die("packet of #{event[:data].bytesize} bytes is longer than #{MAX_METRICS_LENGTH}") if event[:data].bytesize > MAX_METRICS_LENGTH
                 events.each do |e|
                     expected_data = e[:data].map {|m| "#{m[:name]}:#{m[:values].join(":")}"}.sort
                     actual_data = event[:data].split("\n").sort
@@ -347,10 +566,18 @@ def set_test_timeout(t)
     @sat.timeout = t
 end
 
+def set_config(name, value)
+    @sat.config[name] = value
+end
+
 def send_data(data)
     @sat.test_sequence << [:send_data_impl, data]
 end
 
+def register_alias(id, name)
+    @sat.test_sequence << [:register_alias_impl, "#{id} #{name}"]
+end
+
 # syntactic sugar end
 
 # test configuration is done, now let's run it
@@ -0,0 +1,82 @@
+/**
+ * statsd-binary.h: reference encoder of binary datagrams of statsd-aggregator.
+ *
+ * Binary datagram is magic byte 0xA7 followed by records:
+ *
+ *   uint16  name length, or registered alias id with high bit set
+ *   char[]  name (without ':'), absent for alias
+ *   uint8   type: 'c' counter, 'g' gauge, 's' set, 'h' histogram, 'd' distribution, 'm' timer (ms)
+ *   double  value
+ *   double  sample rate, 1 if value is not sampled
+ *
+ * Integers and doubles (IEEE 754) are little endian, records are not aligned.
+ * Datagram should not be larger than the aggregator reads (4096 bytes).
+**/
+
+#ifndef STATSD_BINARY_H
+#define STATSD_BINARY_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#define STATSD_BINARY_MAGIC 0xA7
+#define STATSD_BINARY_ALIAS_FLAG 0x8000
+#define STATSD_BINARY_RECORD_SIZE(name_length) (2 + (name_length) + 1 + 2 * sizeof(double))
+
+// function to start binary datagram, returns its length
+static inline int statsd_binary_start(char *buffer) {
+    buffer[0] = (char)STATSD_BINARY_MAGIC;
+    return 1;
+}
+
+static inline void statsd_binary_double(char *ptr, double value) {
+    uint64_t bits = 0;
+
+    memcpy(&bits, &value, sizeof(bits));
+    bits = htole64(bits);
+    memcpy(ptr, &bits, sizeof(bits));
+}
+
+/* function to append record to the datagram of given length, returns new length of the datagram
+ * or -1 if record doesn't fit into size bytes
+ */
+static inline int statsd_binary_record(char *buffer, int length, int size, const char *name, int name_length,
+        char type, double value, double rate) {
+    uint16_t name_length_le = htole16((uint16_t)name_length);
+
+    if (name_length <= 0 || name_length >= STATSD_BINARY_ALIAS_FLAG || length + (int)STATSD_BINARY_RECORD_SIZE(name_length) > size) {
+        return -1;
+    }
+    memcpy(buffer + length, &name_length_le, sizeof(name_length_le));
+    length += sizeof(name_length_le);
+    memcpy(buffer + length, name, name_length);
+    length += name_length;
+    buffer[length++] = type;
+    statsd_binary_double(buffer + length, value);
+    length += sizeof(double);
+    statsd_binary_double(buffer + length, rate);
+    length += sizeof(double);
+    return length;
+}
+
+/* function to append record with alias id registered over alias socket instead of the name,
+ * returns new length of the datagram or -1 if record doesn't fit into size bytes
+ */
+static inline int statsd_binary_alias_record(char *buffer, int length, int size, int id, char type, double value, double rate) {
+    uint16_t id_le = htole16((uint16_t)(id | STATSD_BINARY_ALIAS_FLAG));
+
+    if (id < 0 || id >= STATSD_BINARY_ALIAS_FLAG || length + (int)STATSD_BINARY_RECORD_SIZE(0) > size) {
+        return -1;
+    }
+    memcpy(buffer + length, &id_le, sizeof(id_le));
+    length += sizeof(id_le);
+    buffer[length++] = type;
+    statsd_binary_double(buffer + length, value);
+    length += sizeof(double);
+    statsd_binary_double(buffer + length, rate);
+    length += sizeof(double);
+    return length;
+}
+
+#endif
@@ -0,0 +1,15 @@
+# Ruby counterpart of statsd-binary.h: encoder of binary datagrams of statsd-aggregator.
+# Datagram is magic byte followed by records: name length (uint16), name, type byte,
+# value and rate (doubles), little endian. Timer type is "m". Name length with high
+# bit set is registered alias id, name is not sent then.
+
+BINARY_MAGIC = 0xA7
+BINARY_ALIAS_FLAG = 0x8000
+
+# records are [name or alias id, type, value, rate], type is "c", "ms", "g" etc.
+def binary_datagram(*records)
+    records.map do |name, type, value, rate|
+        header = name.is_a?(Integer) ? [name | BINARY_ALIAS_FLAG].pack("v") : [name.size].pack("v") + name
+        header + type[0] + [value, rate || 1.0].pack("E2")
+    end.join.prepend(BINARY_MAGIC.chr)
+end
@@ -0,0 +1,398 @@
+/**
+ * throughput: end-to-end throughput and accuracy harness for statsd-aggregator.
+ *
+ * Harness starts the real binary with generated config, fake downstream and
+ * fake health server, sends generated counters and timers and checks that
+ * every counter sum and every timer value count arrived to the downstream.
+ * Each generated line carries exactly one unit (counter increment of 1 or one
+ * timer value) so loss is measured in lines. With -b the same metrics are sent
+ * as binary records instead of text lines.
+**/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "statsd-binary.h"
+
+#define DEFAULT_EXE_FILE "../statsd-aggregator"
+#define CONFIG_FILE "/tmp/statsd-aggregator-throughput.conf"
+#define DEFAULT_DATA_PORT 9300
+#define DEFAULT_METRICS_NUM 1000000
+#define DEFAULT_NAMES_NUM 1000
+#define FLUSH_INTERVAL "0.1"
+// size of generated datagrams, same as typical statsd client would send
+#define PACKET_SIZE 1400
+#define RECEIVE_BUF_SIZE 65536
+#define SOCKET_BUF_SIZE (8 * 1024 * 1024)
+// downstream is considered drained if nothing came during this time
+#define QUIET_TIME 1.0
+#define HEALTH_CHECK_TIMEOUT 10.0
+#define MAX_CONFIG_LINES 16
+
+#define STRLEN(s) (sizeof(s) / sizeof(s[0]) - 1)
+
+#define COUNTER_PREFIX "tp.c."
+#define TIMER_PREFIX "tp.t."
+
+struct harness_s {
+    char *exe_file;
+    // extra config lines for the aggregator
+    char *config_lines[MAX_CONFIG_LINES];
+    int config_lines_num;
+    int data_port;
+    int downstream_port;
+    int health_port;
+    long metrics_num;
+    int names_num;
+    // lines per second, 0 means as fast as possible
+    long rate;
+    // allowed loss in percents
+    double max_loss;
+    // send binary records instead of text lines
+    int binary;
+    // expected and received units for each counter and timer name
+    long *counter_sent;
+    long *timer_sent;
+    double *counter_received;
+    long *timer_received;
+    // anything downstream sent that we didn't generate
+    long unexpected;
+    long packets_received;
+    double first_receive_time;
+    // written by the downstream thread while main thread waits for it to get quiet, accessed atomically
+    double last_receive_time;
+    int downstream_socket;
+    volatile int health_check_done;
+    volatile int stop;
+};
+
+struct harness_s harness;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void die(char *format, char *arg) {
+    fprintf(stderr, format, arg);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int udp_socket(int port) {
+    struct sockaddr_in addr;
+    int buf_size = SOCKET_BUF_SIZE;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (fd < 0) {
+        die("socket() failed %s", strerror(errno));
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+    if (port == 0) {
+        return fd;
+    }
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        die("bind() failed %s", strerror(errno));
+    }
+    return fd;
+}
+
+// function to account single value received from the downstream
+void process_value(char *name, int name_length, char *value, int value_length) {
+    char *endptr = NULL;
+    long idx = 0;
+    double v = 0;
+
+    if (name_length > (int)STRLEN(COUNTER_PREFIX) && memcmp(name, COUNTER_PREFIX, STRLEN(COUNTER_PREFIX)) == 0) {
+        idx = strtol(name + STRLEN(COUNTER_PREFIX), &endptr, 10);
+        v = strtod(value, &endptr);
+        if (idx >= 0 && idx < harness.names_num && endptr - value + 2 == value_length && memcmp(endptr, "|c", 2) == 0) {
+            harness.counter_received[idx] += v;
+            return;
+        }
+    } else if (name_length > (int)STRLEN(TIMER_PREFIX) && memcmp(name, TIMER_PREFIX, STRLEN(TIMER_PREFIX)) == 0) {
+        idx = strtol(name + STRLEN(TIMER_PREFIX), &endptr, 10);
+        if (idx >= 0 && idx < harness.names_num && value_length == 4 && memcmp(value, "7|ms", 4) == 0) {
+            harness.timer_received[idx]++;
+            return;
+        }
+    }
+    harness.unexpected++;
+    fprintf(stderr, "unexpected data \"%.*s:%.*s\"\n", name_length, name, value_length, value);
+}
+
+// function to split downstream packet into lines and lines into values
+void process_packet(char *buffer, int length) {
+    char *line = buffer;
+    char *line_end = NULL;
+    char *value = NULL;
+    char *value_end = NULL;
+    char *name_end = NULL;
+
+    while (line < buffer + length && (line_end = memchr(line, '\n', buffer + length - line)) != NULL) {
+        name_end = memchr(line, ':', line_end - line);
+        if (name_end == NULL) {
+            harness.unexpected++;
+            fprintf(stderr, "unexpected line \"%.*s\"\n", (int)(line_end - line), line);
+        } else {
+            for (value = name_end + 1; value < line_end; value = value_end + 1) {
+                value_end = memchr(value, ':', line_end - value);
+                if (value_end == NULL) {
+                    value_end = line_end;
+                }
+                process_value(line, name_end - line, value, value_end - value);
+            }
+        }
+        line = line_end + 1;
+    }
+}
+
+void *downstream_thread(void *args) {
+    char buffer[RECEIVE_BUF_SIZE];
+    struct timeval tv = { 0, 100000 };
+    double receive_time = 0;
+    int n = 0;
+
+    setsockopt(harness.downstream_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while (!harness.stop) {
+        n = recv(harness.downstream_socket, buffer, RECEIVE_BUF_SIZE, 0);
+        if (n <= 0) {
+            continue;
+        }
+        if (harness.packets_received++ == 0) {
+            harness.first_receive_time = now();
+        }
+        receive_time = now();
+        __atomic_store(&(harness.last_receive_time), &receive_time, __ATOMIC_RELAXED);
+        process_packet(buffer, n);
+    }
+    return NULL;
+}
+
+void *health_client_thread(void *args) {
+    int fd = (int)(long)args;
+    char buffer[64];
+
+    while (recv(fd, buffer, sizeof(buffer), 0) > 0) {
+        send(fd, "health: up\n", 11, MSG_NOSIGNAL);
+        harness.health_check_done = 1;
+    }
+    close(fd);
+    return NULL;
+}
+
+void *health_server_thread(void *args) {
+    struct sockaddr_in addr;
+    pthread_t thread;
+    int one = 1;
+    int client_fd = 0;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(harness.health_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+        die("health server bind() failed %s", strerror(errno));
+    }
+    while ((client_fd = accept(fd, NULL, NULL)) >= 0) {
+        pthread_create(&thread, NULL, health_client_thread, (void *)(long)client_fd);
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+pid_t start_aggregator() {
+    FILE *config = fopen(CONFIG_FILE, "w");
+    pid_t pid = 0;
+    int i = 0;
+
+    if (config == NULL) {
+        die("fopen() failed %s", strerror(errno));
+    }
+    fprintf(config, "log_level=4\n");
+    fprintf(config, "data_port=%d\n", harness.data_port);
+    fprintf(config, "downstream_flush_interval=%s\n", FLUSH_INTERVAL);
+    fprintf(config, "downstream_health_check_interval=0.5\n");
+    fprintf(config, "downstream=127.0.0.1:%d:%d\n", harness.downstream_port, harness.health_port);
+    for (i = 0; i < harness.config_lines_num; i++) {
+        fprintf(config, "%s\n", harness.config_lines[i]);
+    }
+    fclose(config);
+    pid = fork();
+    if (pid == 0) {
+        execl(harness.exe_file, harness.exe_file, CONFIG_FILE, (char *)NULL);
+        die("execl() failed %s", strerror(errno));
+    }
+    return pid;
+}
+
+// function to generate all metrics and send them to the aggregator
+double send_metrics() {
+    char packet[PACKET_SIZE + 64];
+    char name[64];
+    struct sockaddr_in addr;
+    int fd = udp_socket(0);
+    int name_length = 0;
+    int length = harness.binary ? statsd_binary_start(packet) : 0;
+    long i = 0;
+    long idx = 0;
+    double start = now();
+    double elapsed = 0;
+
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(harness.data_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (i = 0; i < harness.metrics_num; i++) {
+        // names are visited with a stride so that one packet has many different names
+        idx = (i * 7919) % harness.names_num;
+        if (harness.binary) {
+            name_length = sprintf(name, "%s%ld", (i % 2 == 0) ? COUNTER_PREFIX : TIMER_PREFIX, idx);
+            length = statsd_binary_record(packet, length, sizeof(packet), name, name_length, (i % 2 == 0) ? 'c' : 'm', (i % 2 == 0) ? 1 : 7, 1);
+        } else if (i % 2 == 0) {
+            length += sprintf(packet + length, COUNTER_PREFIX "%ld:1|c\n", idx);
+        } else {
+            length += sprintf(packet + length, TIMER_PREFIX "%ld:7|ms\n", idx);
+        }
+        if (i % 2 == 0) {
+            harness.counter_sent[idx]++;
+        } else {
+            harness.timer_sent[idx]++;
+        }
+        if (length >= PACKET_SIZE - 32 || i == harness.metrics_num - 1) {
+            if (sendto(fd, packet, length, 0, (struct sockaddr *)&addr, sizeof(addr)) != length) {
+                die("sendto() failed %s", strerror(errno));
+            }
+            length = harness.binary ? statsd_binary_start(packet) : 0;
+            // simple pacing, we sleep if we are ahead of schedule
+            while (harness.rate > 0 && (i + 1) > (now() - start) * harness.rate) {
+                usleep(100);
+            }
+        }
+    }
+    elapsed = now() - start;
+    close(fd);
+    return elapsed;
+}
+
+int check_results(double send_time) {
+    long sent = 0;
+    long received = 0;
+    long mismatched = 0;
+    double loss = 0;
+    int i = 0;
+
+    for (i = 0; i < harness.names_num; i++) {
+        sent += harness.counter_sent[i] + harness.timer_sent[i];
+        received += (long)harness.counter_received[i] + harness.timer_received[i];
+        // receiving more than we've sent can't be explained by the udp loss
+        if (harness.counter_received[i] > harness.counter_sent[i] || harness.counter_received[i] != (long)harness.counter_received[i]) {
+            fprintf(stderr, "counter " COUNTER_PREFIX "%d: sent %ld, received %.15g\n", i, harness.counter_sent[i], harness.counter_received[i]);
+            mismatched++;
+        }
+        if (harness.timer_received[i] > harness.timer_sent[i]) {
+            fprintf(stderr, "timer " TIMER_PREFIX "%d: sent %ld, received %ld\n", i, harness.timer_sent[i], harness.timer_received[i]);
+            mismatched++;
+        }
+    }
+    loss = sent > 0 ? 100.0 * (sent - received) / sent : 0;
+    printf("sent %ld metrics in %.3f s (%.0f metrics/s)\n", sent, send_time, sent / send_time);
+    printf("received %ld metrics in %ld packets in %.3f s (%.0f metrics/s)\n", received, harness.packets_received,
+        harness.last_receive_time - harness.first_receive_time,
+        received / (harness.last_receive_time - harness.first_receive_time));
+    printf("loss %.4f%%, mismatched names %ld, unexpected values %ld\n", loss, mismatched, harness.unexpected);
+    return (mismatched > 0 || harness.unexpected > 0 || loss > harness.max_loss) ? 1 : 0;
+}
+
+void usage(char *name) {
+    fprintf(stderr, "Usage: %s [-e statsd-aggregator] [-p data_port] [-n metrics] [-k names] [-r rate] [-l max_loss_percent] [-o config_line]... [-b]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    pthread_t downstream;
+    pthread_t health_server;
+    pid_t pid = 0;
+    double send_time = 0;
+    double send_end_time = 0;
+    double last_receive_time = 0;
+    double deadline = 0;
+    int opt = 0;
+    int status = 0;
+
+    harness.exe_file = DEFAULT_EXE_FILE;
+    harness.data_port = DEFAULT_DATA_PORT;
+    harness.metrics_num = DEFAULT_METRICS_NUM;
+    harness.names_num = DEFAULT_NAMES_NUM;
+    while ((opt = getopt(argc, argv, "be:p:n:k:r:l:o:")) != -1) {
+        switch (opt) {
+            case 'b': harness.binary = 1; break;
+            case 'e': harness.exe_file = optarg; break;
+            case 'p': harness.data_port = atoi(optarg); break;
+            case 'n': harness.metrics_num = atol(optarg); break;
+            case 'k': harness.names_num = atoi(optarg); break;
+            case 'r': harness.rate = atol(optarg); break;
+            case 'l': harness.max_loss = atof(optarg); break;
+            case 'o':
+                if (harness.config_lines_num == MAX_CONFIG_LINES) {
+                    usage(argv[0]);
+                }
+                harness.config_lines[harness.config_lines_num++] = optarg;
+                break;
+            default: usage(argv[0]);
+        }
+    }
+    if (harness.names_num <= 0 || harness.metrics_num <= 0) {
+        usage(argv[0]);
+    }
+    harness.downstream_port = harness.data_port + 100;
+    harness.health_port = harness.data_port + 200;
+    harness.counter_sent = calloc(harness.names_num, sizeof(long));
+    harness.timer_sent = calloc(harness.names_num, sizeof(long));
+    harness.counter_received = calloc(harness.names_num, sizeof(double));
+    harness.timer_received = calloc(harness.names_num, sizeof(long));
+    harness.downstream_socket = udp_socket(harness.downstream_port);
+
+    pthread_create(&health_server, NULL, health_server_thread, NULL);
+    pthread_create(&downstream, NULL, downstream_thread, NULL);
+    pid = start_aggregator();
+    deadline = now() + HEALTH_CHECK_TIMEOUT;
+    while (!harness.health_check_done) {
+        if (now() > deadline || waitpid(pid, &status, WNOHANG) == pid) {
+            die("%s didn't check downstream health", harness.exe_file);
+        }
+        usleep(10000);
+    }
+    // give aggregator time to process health check reply
+    usleep(100000);
+    send_time = send_metrics();
+    send_end_time = now();
+    // wait till downstream is drained
+    do {
+        usleep(100000);
+        __atomic_load(&(harness.last_receive_time), &last_receive_time, __ATOMIC_RELAXED);
+    } while (now() - (last_receive_time > send_end_time ? last_receive_time : send_end_time) < QUIET_TIME);
+    harness.stop = 1;
+    pthread_join(downstream, NULL);
+    kill(pid, SIGINT);
+    waitpid(pid, &status, 0);
+    return check_results(send_time);
+}